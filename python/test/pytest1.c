@@ -70,6 +70,7 @@ PyInit_pytest1(void)
     loadBitcode("python/test/pytest1.c.ll");
     loadBitcode("python/cpython_ll");
 
+    setJitHotThreshold(1);
     jit_target = createJitTarget(&_pytest1_target, 0);
 
     PyObject *m;
@@ -70,6 +70,7 @@ PyInit_pytest2(void)
     loadBitcode("python/test/pytest2.c.ll");
     loadBitcode("python/cpython_ll");
 
+    setJitHotThreshold(1);
     jit_target = createJitTarget(&_pytest2_target, 0);
 
     PyObject *m;
@@ -70,6 +70,7 @@ PyInit_pytest3(void)
     loadBitcode("python/test/pytest3.c.ll");
     loadBitcode("python/cpython_ll");
 
+    setJitHotThreshold(1);
     jit_target = createJitTarget(&_pytest3_target, 1);
 
     PyObject *m;
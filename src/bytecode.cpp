@@ -0,0 +1,269 @@
+#include "bytecode.h"
+
+#include <unordered_map>
+
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+#include "common.h"
+
+using namespace llvm;
+using namespace std;
+
+namespace dcop {
+
+const llvm::Value* DecodedFunction::valueOf(const Operand& op) const {
+    if (op.slot >= 0)
+        return slot_values[op.slot];
+    return op.constant;
+}
+
+namespace {
+
+// Calls that have no effect on what the trace computes
+bool isIgnoredCall(const Instruction& instr) {
+    auto call = dyn_cast<CallInst>(&instr);
+    if (!call || !isa<Function>(call->getCalledValue()))
+        return false;
+    auto name = call->getCalledValue()->getName();
+    return name == "llvm.dbg.value" || name == "llvm.dbg.declare"
+           || name == "llvm.lifetime.start.p0i8"
+           || name == "llvm.lifetime.end.p0i8";
+}
+
+class Decoder {
+private:
+    DecodedFunction& code;
+    const DataLayout& data_layout;
+
+    unordered_map<const llvm::Value*, int> slots;
+    unordered_map<const BasicBlock*, int> block_indices;
+
+    // Set when an instruction has an operand we can't represent
+    bool unsupported;
+
+    int addOperand(const llvm::Value* v, long scale = 0) {
+        Operand op{ -1, nullptr, scale };
+        auto it = slots.find(v);
+        if (it != slots.end())
+            op.slot = it->second;
+        else if (isa<Constant>(v))
+            op.constant = cast<Constant>(v);
+        else
+            unsupported = true;
+        code.operands.push_back(op);
+        return code.operands.size() - 1;
+    }
+
+    void addEdge(const BasicBlock* bb, long case_value = 0, int operand = -1) {
+        code.edges.push_back(Edge{ block_indices[bb], case_value, operand });
+    }
+
+    int bitsOf(const llvm::Value* v) {
+        return data_layout.getTypeSizeInBits(v->getType());
+    }
+
+    void decodeGep(const GetElementPtrInst& gep, DecodedInst& inst) {
+        inst.opcode = DecodedInst::GEP;
+        inst.offset = 0;
+        addOperand(gep.getPointerOperand());
+
+        // Constant indices (which includes every struct index) get folded
+        // into the offset; the rest are kept along with their scale.
+        for (auto GTI = gep_type_begin(&gep), GTE = gep_type_end(&gep);
+             GTI != GTE; ++GTI) {
+            llvm::Value* idx = GTI.getOperand();
+            auto cidx = dyn_cast<ConstantInt>(idx);
+
+            if (StructType* STy = GTI.getStructTypeOrNull()) {
+                if (!cidx) {
+                    unsupported = true;
+                    continue;
+                }
+                inst.offset += data_layout.getStructLayout(STy)
+                                   ->getElementOffset(cidx->getZExtValue());
+                continue;
+            }
+
+            long scale = data_layout.getTypeAllocSize(GTI.getIndexedType());
+            if (cidx)
+                inst.offset += cidx->getSExtValue() * scale;
+            else
+                addOperand(idx, scale);
+        }
+    }
+
+    void decodeInst(const Instruction& instr, int block) {
+        DecodedInst inst;
+        inst.opcode = DecodedInst::Unhandled;
+        inst.subop = 0;
+        inst.bits = inst.result_bits = inst.size = 0;
+        auto it = slots.find(&instr);
+        inst.slot = it == slots.end() ? -1 : it->second;
+        inst.block = block;
+        inst.first_operand = code.operands.size();
+        inst.first_edge = code.edges.size();
+        inst.offset = 0;
+        inst.inst = &instr;
+        unsupported = false;
+
+        if (isa<CmpInst>(instr)) {
+            auto& cmp = cast<CmpInst>(instr);
+            RELEASE_ASSERT(
+                bitsOf(cmp.getOperand(0)) == bitsOf(cmp.getOperand(1)), "");
+            inst.opcode = DecodedInst::ICmp;
+            inst.subop = cmp.getPredicate();
+            inst.bits = bitsOf(cmp.getOperand(0));
+            addOperand(cmp.getOperand(0));
+            addOperand(cmp.getOperand(1));
+        } else if (isa<BinaryOperator>(instr)) {
+            inst.opcode = DecodedInst::BinOp;
+            inst.subop = instr.getOpcode();
+            inst.bits = bitsOf(instr.getOperand(0));
+            addOperand(instr.getOperand(0));
+            addOperand(instr.getOperand(1));
+        } else if (isa<SelectInst>(instr)) {
+            auto& select = cast<SelectInst>(instr);
+            inst.opcode = DecodedInst::Select;
+            addOperand(select.getCondition());
+            addOperand(select.getTrueValue());
+            addOperand(select.getFalseValue());
+        } else if (isa<GetElementPtrInst>(instr)) {
+            decodeGep(cast<GetElementPtrInst>(instr), inst);
+        } else if (isa<LoadInst>(instr)) {
+            inst.opcode = DecodedInst::Load;
+            inst.size = data_layout.getTypeStoreSize(instr.getType());
+            addOperand(cast<LoadInst>(instr).getPointerOperand());
+        } else if (isa<StoreInst>(instr)) {
+            auto& store = cast<StoreInst>(instr);
+            inst.opcode = DecodedInst::Store;
+            inst.size = data_layout.getTypeStoreSize(
+                store.getValueOperand()->getType());
+            addOperand(store.getPointerOperand());
+            addOperand(store.getValueOperand());
+        } else if (isa<AllocaInst>(instr)) {
+            // Dynamically-sized allocas aren't supported
+            if (auto bits = cast<AllocaInst>(instr).getAllocationSizeInBits(
+                    data_layout)) {
+                inst.opcode = DecodedInst::Alloca;
+                inst.size = *bits;
+            }
+        } else if (isa<CastInst>(instr)) {
+            inst.opcode = DecodedInst::Cast;
+            inst.subop = instr.getOpcode();
+            inst.bits = bitsOf(instr.getOperand(0));
+            inst.result_bits = bitsOf(&instr);
+            addOperand(instr.getOperand(0));
+        } else if (isa<CallInst>(instr)) {
+            auto& call = cast<CallInst>(instr);
+            auto callee = dyn_cast<Function>(call.getCalledValue());
+            if (callee && callee->getName() == "llvm.va_start") {
+                inst.opcode = DecodedInst::VaStart;
+                addOperand(call.getArgOperand(0));
+            } else if (callee && callee->getName() == "llvm.va_end") {
+                inst.opcode = DecodedInst::VaEnd;
+            } else {
+                inst.opcode = DecodedInst::Call;
+                addOperand(call.getCalledValue());
+                for (auto& use : call.arg_operands())
+                    addOperand(use);
+            }
+        } else if (isa<ReturnInst>(instr)) {
+            inst.opcode = DecodedInst::Ret;
+            if (auto retval = cast<ReturnInst>(instr).getReturnValue())
+                addOperand(retval);
+        } else if (isa<BranchInst>(instr)) {
+            auto& br = cast<BranchInst>(instr);
+            if (br.isUnconditional()) {
+                inst.opcode = DecodedInst::Br;
+                addEdge(br.getSuccessor(0));
+            } else {
+                inst.opcode = DecodedInst::CondBr;
+                addOperand(br.getCondition());
+                addEdge(br.getSuccessor(0));
+                addEdge(br.getSuccessor(1));
+            }
+        } else if (isa<SwitchInst>(instr)) {
+            auto& sw = cast<SwitchInst>(instr);
+            inst.opcode = DecodedInst::Switch;
+            addOperand(sw.getCondition());
+            addEdge(sw.getDefaultDest());
+            for (auto case_ : sw.cases())
+                addEdge(case_.getCaseSuccessor(),
+                        case_.getCaseValue()->getSExtValue());
+        } else if (isa<PHINode>(instr)) {
+            auto& phi = cast<PHINode>(instr);
+            inst.opcode = DecodedInst::Phi;
+            for (int i = 0; i < phi.getNumIncomingValues(); i++)
+                addEdge(phi.getIncomingBlock(i), 0,
+                        addOperand(phi.getIncomingValue(i)));
+        }
+
+        if (unsupported)
+            inst.opcode = DecodedInst::Unhandled;
+        inst.num_operands = code.operands.size() - inst.first_operand;
+        inst.num_edges = code.edges.size() - inst.first_edge;
+        code.insts.push_back(inst);
+    }
+
+public:
+    Decoder(DecodedFunction& code, const DataLayout& data_layout)
+        : code(code), data_layout(data_layout) {}
+
+    void decode(const Function* func) {
+        code.function = func;
+
+        // Number everything up front, since phis can refer to values that
+        // are defined further down.
+        for (auto& arg : func->args()) {
+            slots[&arg] = code.slot_values.size();
+            code.slot_values.push_back(&arg);
+        }
+        int num_blocks = 0;
+        for (auto& bb : *func) {
+            block_indices[&bb] = num_blocks++;
+            for (auto& instr : bb) {
+                if (instr.getType()->isVoidTy())
+                    continue;
+                slots[&instr] = code.slot_values.size();
+                code.slot_values.push_back(&instr);
+            }
+        }
+
+        DominatorTree dt(const_cast<Function&>(*func));
+
+        for (auto& bb : *func) {
+            DecodedBlock block;
+            block.bb = &bb;
+            block.start = code.insts.size();
+            block.first_non_phi = block.start + distance(bb.phis().begin(),
+                                                         bb.phis().end());
+            block.is_loop_header = false;
+            for (auto pred : predecessors(&bb)) {
+                if (dt.dominates(&bb, pred))
+                    block.is_loop_header = true;
+            }
+
+            int index = code.blocks.size();
+            code.blocks.push_back(block);
+            for (auto& instr : bb) {
+                if (!isIgnoredCall(instr))
+                    decodeInst(instr, index);
+            }
+        }
+    }
+};
+}
+
+std::unique_ptr<DecodedFunction> decodeFunction(const llvm::Function* func) {
+    RELEASE_ASSERT(!func->empty(), "no body??");
+    std::unique_ptr<DecodedFunction> code(new DecodedFunction());
+    Decoder(*code, func->getParent()->getDataLayout()).decode(func);
+    return code;
+}
+}
@@ -0,0 +1,108 @@
+#ifndef _DCOP_BYTECODE_H
+#define _DCOP_BYTECODE_H
+
+#include <memory>
+#include <vector>
+
+namespace llvm {
+class BasicBlock;
+class Constant;
+class Function;
+class Instruction;
+class Value;
+}
+
+namespace dcop {
+
+// Functions get decoded once into a flat array of DecodedInsts before the
+// interpreter runs them, so that working out what kind of instruction we
+// are looking at, how wide its operands are, and where a GEP points is done
+// once per instruction instead of once per execution.
+//
+// Arguments and value-producing instructions are numbered into slots;
+// operands refer to either a slot or a constant.
+
+struct Operand {
+    int slot;                       // -1 for constants
+    const llvm::Constant* constant; // nullptr for slots
+    long scale;                     // GEP indices: bytes per unit of the index
+};
+
+// Successors of a branch or switch, or incoming blocks of a phi.
+struct Edge {
+    int block;
+    long case_value; // switches only
+    int operand;     // phis only: index into DecodedFunction::operands
+};
+
+struct DecodedInst {
+    enum Opcode : unsigned char {
+        ICmp,
+        BinOp,
+        Select,
+        GEP,
+        Load,
+        Store,
+        Cast,
+        Alloca,
+        Call,
+        VaStart,
+        VaEnd,
+        Ret,
+        Br,
+        CondBr,
+        Switch,
+        Phi,
+        Unhandled, // only an error if it actually gets executed
+    } opcode;
+
+    unsigned subop; // predicate, binary operator or cast opcode
+    int bits;       // width of the first operand, and of a cast's result
+    int result_bits;
+    int size;       // bytes for loads and stores, bits for allocas
+    int slot;       // where the result goes, or -1
+    int block;
+
+    int first_operand;
+    int num_operands;
+    int first_edge;
+    int num_edges;
+
+    long offset; // constant part of a GEP's offset
+
+    const llvm::Instruction* inst;
+};
+
+struct DecodedBlock {
+    const llvm::BasicBlock* bb;
+    int start;
+    int first_non_phi;
+    bool is_loop_header; // target of a back edge
+};
+
+struct DecodedFunction {
+    const llvm::Function* function;
+
+    std::vector<DecodedInst> insts;
+    std::vector<DecodedBlock> blocks; // entry block first
+    std::vector<Operand> operands;
+    std::vector<Edge> edges;
+
+    // What each slot holds; the arguments come first
+    std::vector<const llvm::Value*> slot_values;
+
+    int numSlots() const { return slot_values.size(); }
+
+    const Operand& operand(const DecodedInst& inst, int i) const {
+        return operands[inst.first_operand + i];
+    }
+    const Edge& edge(const DecodedInst& inst, int i) const {
+        return edges[inst.first_edge + i];
+    }
+    const llvm::Value* valueOf(const Operand& op) const;
+};
+
+std::unique_ptr<DecodedFunction> decodeFunction(const llvm::Function* func);
+}
+
+#endif
@@ -0,0 +1,345 @@
+#include "codeheap.h"
+
+#include <cstring>
+#include <link.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+
+#include "common.h"
+
+using namespace llvm;
+using namespace std;
+
+namespace dcop {
+
+static const size_t slab_size = 2 * 1024 * 1024;
+
+// Everything the heap will ever hold.  Keeping code and data in one range
+// this small is what lets traces use the small code model.
+static const size_t reservation_size = (size_t)1 << 30;
+
+// How far rel32 references reach
+static const uintptr_t reach = INT32_MAX;
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+// The range of addresses the main executable is loaded at
+static int findMainImage(struct dl_phdr_info* info, size_t size, void* data) {
+    auto range = (pair<uintptr_t, uintptr_t>*)data;
+    range->first = UINTPTR_MAX;
+    range->second = 0;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        auto& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type != PT_LOAD)
+            continue;
+        uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+        range->first = min(range->first, start);
+        range->second = max(range->second, start + phdr.p_memsz);
+    }
+    // The main executable always comes first
+    return 1;
+}
+
+// Kernels older than 4.17 take MAP_FIXED_NOREPLACE as a hint, so whether we
+// got the address has to be checked either way.
+static bool reserveAt(uintptr_t address) {
+    void* p = mmap((void*)address, reservation_size, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+                       | MAP_FIXED_NOREPLACE,
+                   -1, 0);
+    if (p == MAP_FAILED)
+        return false;
+    if ((uintptr_t)p != address) {
+        munmap(p, reservation_size);
+        return false;
+    }
+    return true;
+}
+
+// Maps over part of the reservation.  A failed MAP_FIXED mapping can leave a
+// hole where the old one was, so that gets plugged up again.
+static bool mapAt(uint8_t* address, size_t size, int prot, int flags,
+                  int fd) {
+    if (mmap(address, size, prot, flags | MAP_FIXED, fd, 0) != MAP_FAILED)
+        return true;
+    mmap(address, size, PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    return false;
+}
+
+// Both views of a code slab.  The memfd can be backed by reserved huge pages
+// (vm.nr_hugepages); if there are none, mapping it fails and we go again
+// without them.
+static bool mapCodeSlab(uint8_t* address, size_t size, unsigned memfd_flags,
+                        uint8_t** writable) {
+    int fd = memfd_create("dpro-code", MFD_CLOEXEC | memfd_flags);
+    if (fd < 0)
+        return false;
+
+    void* w = MAP_FAILED;
+    if (ftruncate(fd, size) == 0
+        && mapAt(address, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd))
+        w = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (w == MAP_FAILED)
+        return false;
+    *writable = (uint8_t*)w;
+    return true;
+}
+
+CodeHeap& CodeHeap::get() {
+    // Never destroyed, since memory managers can outlive any static
+    static CodeHeap* heap = new CodeHeap();
+    return *heap;
+}
+
+// Try to put the whole heap within rel32 reach of the main executable,
+// first below it, and then above it, leaving room for brk to grow into.
+CodeHeap::CodeHeap() {
+    pair<uintptr_t, uintptr_t> image;
+    dl_iterate_phdr(findMainImage, &image);
+    main_start = image.first;
+    main_end = image.second;
+
+    const uintptr_t step = 64 * 1024 * 1024;
+    const uintptr_t brk_room = 256 * 1024 * 1024;
+    uintptr_t lowest = main_end > reach ? main_end - reach : 0;
+    uintptr_t highest = main_start + reach - reservation_size;
+
+    near_main = false;
+    if (main_start > reservation_size + step) {
+        uintptr_t address
+            = alignDown(main_start - reservation_size, slab_size);
+        for (; address >= max(lowest, step); address -= step) {
+            if ((near_main = reserveAt(address)))
+                break;
+        }
+        reserved_next = (uint8_t*)address;
+    }
+    if (!near_main) {
+        uintptr_t address = alignTo(main_end + brk_room, slab_size);
+        for (; address <= highest; address += step) {
+            if ((near_main = reserveAt(address)))
+                break;
+        }
+        reserved_next = (uint8_t*)address;
+    }
+
+    if (!near_main) {
+        void* p = mmap(nullptr, reservation_size + slab_size, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        RELEASE_ASSERT(p != MAP_FAILED, "couldn't reserve the code heap");
+        reserved_next = (uint8_t*)alignTo((uintptr_t)p, slab_size);
+    }
+    reserved_end = reserved_next + reservation_size;
+}
+
+bool CodeHeap::canReach(const void* address) {
+    return near_main && (uintptr_t)address >= main_start
+           && (uintptr_t)address < main_end;
+}
+
+void CodeHeap::addSlab(size_t min_size, bool code) {
+    Slab slab;
+    slab.size = alignTo(min_size, slab_size);
+    // Objects only get loaded if hasRoomFor() says they fit
+    RELEASE_ASSERT(reserved_next + slab.size <= reserved_end,
+                   "the code heap is full");
+    slab.address = reserved_next;
+
+    if (code) {
+        if (!mapCodeSlab(slab.address, slab.size, MFD_HUGETLB,
+                         &slab.writable)) {
+            RELEASE_ASSERT(mapCodeSlab(slab.address, slab.size, 0,
+                                       &slab.writable),
+                           "couldn't map %ld bytes of code", slab.size);
+            // Transparent huge pages, if shmem is allowed to use them
+            madvise(slab.address, slab.size, MADV_HUGEPAGE);
+        }
+    } else {
+        if (!mapAt(slab.address, slab.size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1)) {
+            RELEASE_ASSERT(mapAt(slab.address, slab.size,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1),
+                           "couldn't map %ld bytes of data", slab.size);
+            madvise(slab.address, slab.size, MADV_HUGEPAGE);
+        }
+        slab.writable = slab.address;
+    }
+    reserved_next += slab.size;
+
+    slabs[code].push_back(slab);
+    free_blocks[code][slab.address]
+        = FreeBlock{ slab.size, (int)slabs[code].size() - 1 };
+}
+
+int CodeHeap::slabOf(uint8_t* address, bool code) {
+    for (int i = 0; i < slabs[code].size(); i++) {
+        auto& slab = slabs[code][i];
+        if (address >= slab.address && address < slab.address + slab.size)
+            return i;
+    }
+    RELEASE_ASSERT(0, "%p isn't in the code heap", address);
+}
+
+CodeHeap::Block CodeHeap::allocate(size_t size, unsigned alignment,
+                                   bool code) {
+    // Rounding everything to 16 bytes keeps slivers out of the free lists
+    size = alignTo(max(size, (size_t)1), 16);
+    alignment = max(alignment, 16u);
+
+    lock_guard<mutex> guard(lock);
+    auto& blocks = free_blocks[code];
+    while (true) {
+        // First fit
+        for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+            uint8_t* start = it->first;
+            FreeBlock free_block = it->second;
+            uint8_t* end = start + free_block.size;
+            auto aligned = (uint8_t*)alignTo((uintptr_t)start, alignment);
+            if (aligned + size > end)
+                continue;
+
+            blocks.erase(it);
+            if (aligned > start)
+                blocks[start] = FreeBlock{ (size_t)(aligned - start),
+                                           free_block.slab };
+            if (aligned + size < end)
+                blocks[aligned + size] = FreeBlock{
+                    (size_t)(end - aligned - size), free_block.slab
+                };
+
+            bytes_in_use += size;
+            auto& slab = slabs[code][free_block.slab];
+            return Block{ aligned, slab.writable + (aligned - slab.address),
+                          size, code };
+        }
+
+        addSlab(size + alignment, code);
+    }
+}
+
+void CodeHeap::free(const Block& block) {
+    // Anything that jumps into freed code traps
+    if (block.code)
+        memset(block.writable, 0xcc, block.size);
+
+    lock_guard<mutex> guard(lock);
+    auto& blocks = free_blocks[block.code];
+    int slab = slabOf(block.address, block.code);
+    uint8_t* start = block.address;
+    size_t size = block.size;
+    bytes_in_use -= size;
+
+    auto next = blocks.lower_bound(start);
+    if (next != blocks.end() && next->first == start + size
+        && next->second.slab == slab) {
+        size += next->second.size;
+        next = blocks.erase(next);
+    }
+    if (next != blocks.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second.size == start
+            && prev->second.slab == slab) {
+            start = prev->first;
+            size += prev->second.size;
+            blocks.erase(prev);
+        }
+    }
+    blocks[start] = FreeBlock{ size, slab };
+}
+
+bool CodeHeap::hasRoomFor(size_t object_size) {
+    // Neither the code nor the data that get loaded from an object take
+    // more than twice its size, rounding and stubs included.
+    size_t needed = 2 * object_size + 4096;
+
+    lock_guard<mutex> guard(lock);
+    size_t unreserved = reserved_end - reserved_next;
+    for (bool code : { true, false }) {
+        bool fits = false;
+        for (auto& p : free_blocks[code]) {
+            if (p.second.size >= needed) {
+                fits = true;
+                break;
+            }
+        }
+        if (fits)
+            continue;
+
+        size_t slab = alignTo(needed + 16, slab_size);
+        if (slab > unreserved)
+            return false;
+        unreserved -= slab;
+    }
+    return true;
+}
+
+size_t CodeHeap::bytesReserved() {
+    lock_guard<mutex> guard(lock);
+    size_t r = 0;
+    for (auto& kind : slabs) {
+        for (auto& slab : kind)
+            r += slab.size;
+    }
+    return r;
+}
+
+size_t CodeHeap::bytesInUse() {
+    lock_guard<mutex> guard(lock);
+    return bytes_in_use;
+}
+
+TraceMemoryManager::~TraceMemoryManager() {
+    // The unwinder mustn't look at the frames once they're freed
+    deregisterEHFrames();
+    for (auto& block : blocks)
+        CodeHeap::get().free(block);
+}
+
+uint8_t* TraceMemoryManager::allocateCodeSection(uintptr_t size,
+                                                 unsigned alignment,
+                                                 unsigned section_id,
+                                                 StringRef section_name) {
+    blocks.push_back(CodeHeap::get().allocate(size, alignment, true));
+    return blocks.back().writable;
+}
+
+// Read-only data goes in with the writable data, since pages are shared
+// between objects and can't be protected per object.
+uint8_t* TraceMemoryManager::allocateDataSection(uintptr_t size,
+                                                 unsigned alignment,
+                                                 unsigned section_id,
+                                                 StringRef section_name,
+                                                 bool read_only) {
+    blocks.push_back(CodeHeap::get().allocate(size, alignment, false));
+    return blocks.back().address;
+}
+
+void TraceMemoryManager::notifyObjectLoaded(RuntimeDyld& dyld,
+                                            const object::ObjectFile& obj) {
+    // Relocations haven't been resolved yet, so they get computed against
+    // where the code is going to run.
+    for (auto& block : blocks) {
+        if (block.code)
+            dyld.mapSectionAddress(block.writable, (uint64_t)block.address);
+    }
+}
+
+bool TraceMemoryManager::finalizeMemory(std::string* error_msg) {
+    // Code is only ever executable from where it runs, so there's nothing
+    // to protect.
+    for (auto& block : blocks) {
+        if (block.code)
+            sys::Memory::InvalidateInstructionCache(block.address, block.size);
+    }
+    return false;
+}
+}
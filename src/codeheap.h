@@ -0,0 +1,111 @@
+#ifndef _DCOP_CODEHEAP_H
+#define _DCOP_CODEHEAP_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+
+namespace dcop {
+
+// Memory for compiled traces.  SectionMemoryManager gives every object pages
+// of its own, which for a trace of a few hundred bytes is mostly waste, and
+// spreads code out over many pages.  Instead, traces get packed into large
+// slabs shared by all of them, backed by 2MB pages when the system has them.
+//
+// Code slabs are mapped twice: RuntimeDyld writes and relocates code through
+// a writable view, and it runs from an executable one.  No page is ever
+// writable and executable at once, and new traces can be written next to
+// ones that are already running.
+//
+// All the slabs come out of one range, reserved within 2GB of the main
+// executable if there's room there.  Traces are compiled with the small code
+// model, so their code and data have to be within 2GB of each other anyway,
+// and being near the executable lets them reference its functions and
+// globals PC-relatively too.  That is only done for the main executable;
+// shared libraries (libc, or libpython when it is embedded) are always
+// reached through a GOT entry or stub.
+class CodeHeap {
+public:
+    struct Block {
+        uint8_t* address;  // where it is used from
+        uint8_t* writable; // where it gets written; the same for data
+        size_t size;
+        bool code;
+    };
+
+    static CodeHeap& get();
+
+    Block allocate(size_t size, unsigned alignment, bool code);
+    void free(const Block& block);
+
+    size_t bytesReserved();
+    size_t bytesInUse();
+
+    // Whether an object file this big is sure to fit.  Running out of room
+    // part way through loading one is fatal in RuntimeDyld, so objects get
+    // checked first, and ones that don't fit don't get loaded at all.
+    bool hasRoomFor(size_t object_size);
+
+    // Whether code in the heap can reference address with a rel32.  This is
+    // only true of addresses in the main executable, even if a shared
+    // library happens to be loaded close by: where libraries end up differs
+    // from process to process, and cached objects have to work in all of
+    // them.
+    bool canReach(const void* address);
+
+private:
+    struct Slab {
+        uint8_t* address;
+        uint8_t* writable;
+        size_t size;
+    };
+    struct FreeBlock {
+        size_t size;
+        int slab; // blocks in different slabs never get merged
+    };
+
+    uintptr_t main_start, main_end; // where the main executable is
+    bool near_main;
+    uint8_t* reserved_next; // where the next slab goes
+    uint8_t* reserved_end;
+
+    std::mutex lock;
+    std::vector<Slab> slabs[2];                   // indexed by code
+    std::map<uint8_t*, FreeBlock> free_blocks[2]; // by address
+    size_t bytes_in_use = 0;
+
+    CodeHeap();
+
+    void addSlab(size_t min_size, bool code);
+    int slabOf(uint8_t* address, bool code);
+};
+
+// Memory manager for one object, like SectionMemoryManager, but allocating
+// from the CodeHeap.  Its memory goes back to the heap when the object gets
+// removed.
+class TraceMemoryManager : public llvm::RTDyldMemoryManager {
+private:
+    std::vector<CodeHeap::Block> blocks;
+
+public:
+    ~TraceMemoryManager() override;
+
+    uint8_t* allocateCodeSection(uintptr_t size, unsigned alignment,
+                                 unsigned section_id,
+                                 llvm::StringRef section_name) override;
+    uint8_t* allocateDataSection(uintptr_t size, unsigned alignment,
+                                 unsigned section_id,
+                                 llvm::StringRef section_name,
+                                 bool read_only) override;
+
+    using llvm::RTDyldMemoryManager::notifyObjectLoaded;
+    void notifyObjectLoaded(llvm::RuntimeDyld& dyld,
+                            const llvm::object::ObjectFile& obj) override;
+    bool finalizeMemory(std::string* error_msg = nullptr) override;
+};
+}
+
+#endif
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <dlfcn.h>
 #include <memory>
 #include <unordered_map>
@@ -12,6 +13,8 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/Support/SourceMgr.h"
 
+#include "bytecode.h"
+#include "codeheap.h"
 #include "common.h"
 #include "jit.h"
 
@@ -41,6 +44,45 @@ void* findAddressForName(const string& name) {
     return r;
 }
 
+// TODO: handle floating point stuff here
+long callFunction(long addr, const vector<long>& args) {
+    long result;
+    if (args.size() == 0) {
+        auto ptr = (long (*)())addr;
+        result = (*ptr)();
+    } else if (args.size() == 1) {
+        auto ptr = (long (*)(long))addr;
+        result = (*ptr)(args[0]);
+    } else if (args.size() == 2) {
+        auto ptr = (long (*)(long, long))addr;
+        result = (*ptr)(args[0], args[1]);
+    } else if (args.size() == 3) {
+        auto ptr = (long (*)(long, long, long))addr;
+        result = (*ptr)(args[0], args[1], args[2]);
+    } else if (args.size() == 4) {
+        auto ptr = (long (*)(long, long, long, long))addr;
+        result = (*ptr)(args[0], args[1], args[2], args[3]);
+    } else if (args.size() == 5) {
+        auto ptr = (long (*)(long, long, long, long, long))addr;
+        result = (*ptr)(args[0], args[1], args[2], args[3], args[4]);
+    } else if (args.size() == 6) {
+        auto ptr = (long (*)(long, long, long, long, long, long))addr;
+        result = (*ptr)(args[0], args[1], args[2], args[3], args[4], args[5]);
+    } else if (args.size() == 7) {
+        auto ptr = (long (*)(long, long, long, long, long, long, long))addr;
+        result = (*ptr)(args[0], args[1], args[2], args[3], args[4], args[5],
+                        args[6]);
+    } else if (args.size() == 8) {
+        auto ptr
+            = (long (*)(long, long, long, long, long, long, long, long))addr;
+        result = (*ptr)(args[0], args[1], args[2], args[3], args[4], args[5],
+                        args[6], args[7]);
+    } else {
+        RELEASE_ASSERT(0, "%ld", args.size());
+    }
+    return result;
+}
+
 LLVMContext context;
 const DataLayout* data_layout;
 
@@ -83,6 +125,16 @@ public:
         loaded_modules.push_back(move(module));
     }
 
+    bool hasFunction(const string& name) { return functions.count(name); }
+
+    unordered_map<const Function*, unique_ptr<DecodedFunction>> decoded;
+    const DecodedFunction* getDecoded(const Function* func) {
+        auto& code = decoded[func];
+        if (!code)
+            code = decodeFunction(func);
+        return code.get();
+    }
+
     Function* findFunction(string name) {
         RELEASE_ASSERT(functions.count(name), "%s", name.c_str());
         return functions[name];
@@ -94,6 +146,79 @@ const Function* functionForAddress(intptr_t address) {
     return bitcode_registry.findFunction(name);
 }
 
+// Whether we have bitcode for the function at this address.
+bool canTrace(void* address) {
+    Dl_info info;
+    if (!dladdr(address, &info) || !info.dli_sname || info.dli_saddr != address)
+        return false;
+    return bitcode_registry.hasFunction(info.dli_sname);
+}
+
+LLVMCompiler& getCompiler() {
+    static LLVMCompiler compiler;
+    static bool configured = false;
+    if (!configured) {
+        configured = true;
+        const char* env = getenv("DPRO_ASYNC_COMPILE");
+        if (env)
+            compiler.setAsync(atoi(env));
+        env = getenv("DPRO_COMPILE_THREADS");
+        if (env)
+            compiler.setNumThreads(max(1, atoi(env)));
+        env = getenv("DPRO_COMPILE_BATCH");
+        if (env)
+            compiler.setMaxBatch(max(1, atoi(env)));
+        env = getenv("DPRO_TIER_UP_THRESHOLD");
+        if (env)
+            compiler.setTierUpThreshold(atol(env));
+        env = getenv("DPRO_PIPELINE");
+        if (env)
+            compiler.setPipeline(LLVMCompiler::Optimized, env);
+        env = getenv("DPRO_BASELINE_PIPELINE");
+        if (env)
+            compiler.setPipeline(LLVMCompiler::Baseline, env);
+        env = getenv("DPRO_TIME_PASSES");
+        if (env)
+            compiler.setTimePasses(atoi(env));
+        env = getenv("DPRO_BIND_SYMBOLS");
+        if (env)
+            compiler.setBindSymbols(atoi(env));
+        env = getenv("DPRO_PERF_MAP");
+        if (env)
+            compiler.setPerfMap(atoi(env));
+        env = getenv("DPRO_JITDUMP_DIR");
+        if (env && *env)
+            compiler.setJitDumpDir(env);
+        env = getenv("DPRO_DEBUG_INFO");
+        if (env)
+            compiler.setDebugInfo(atoi(env));
+        env = getenv("DPRO_OBJECT_CACHE");
+        if (env && *env)
+            compiler.setCacheDir(env);
+    }
+    return compiler;
+}
+
+// Exits live as long as the traces they are in, which is until their owner
+// gets evicted.
+vector<unique_ptr<SideExit>> side_exits;
+
+// The first target created for each function, by the function's address.
+// Other traces call into it rather than tracing the function again.
+unordered_map<const void*, JitTarget*> jit_targets;
+long sideExit(SideExit* exit, long* live_values);
+
+// How many times a side exit gets taken before a bridge is recorded from it
+static const long default_bridge_threshold = 10;
+static long bridge_threshold = -1;
+
+// Past these limits, calls get emitted as real calls to the native function
+// instead of being inlined into the trace.  Without them recursive functions
+// like fib() get expanded call by call.
+static const int max_recursion_depth = 2; // copies of one function in a stack
+static const int max_inline_depth = 32;
+static const int max_inlining_trace_size = 10000; // instructions
+
 class TraceStrategy {
 public:
     bool shouldntTrace(void* addr) {
@@ -112,6 +237,107 @@ public:
             return false;
         return true;
     }
+    bool shouldInline(int recursion_depth, int inline_depth, int trace_size) {
+        if (recursion_depth >= max_recursion_depth)
+            return false;
+        if (inline_depth >= max_inline_depth)
+            return false;
+        if (trace_size >= max_inlining_trace_size)
+            return false;
+        return true;
+    }
+    bool shouldRecordBridge(SideExit* exit) {
+        if (bridge_threshold == -1) {
+            const char* env = getenv("DPRO_BRIDGE_THRESHOLD");
+            bridge_threshold = env ? atol(env) : default_bridge_threshold;
+        }
+        // Only on the crossing, so that exits taken while the bridge is being
+        // recorded don't start recording it again.
+        return exit->num_exits == bridge_threshold;
+    }
+};
+
+// Where globals live at runtime.  This doesn't change for the life of the
+// process, so every recording shares it.
+unordered_map<const GlobalValue*, long> global_addresses;
+long globalAddress(const GlobalValue* gv) {
+    auto it = global_addresses.find(gv);
+    if (it != global_addresses.end())
+        return it->second;
+
+    long address;
+    auto gvar = dyn_cast<GlobalVariable>(gv);
+    auto arr_type = gvar ? dyn_cast<ArrayType>(cast<PointerType>(
+                               gvar->getType())->getElementType())
+                         : nullptr;
+    if (arr_type && arr_type->getElementType()->isIntegerTy(8)) {
+        // String literals are usually private to their module, so dlsym
+        // won't find them; use a copy instead.  Never freed, since
+        // whatever we pass it to might hold on to it.
+        RELEASE_ASSERT(gvar->isConstant(), "");
+
+        auto initializer = gvar->getInitializer();
+        RELEASE_ASSERT(initializer, "");
+
+        auto init_str = dyn_cast<ConstantDataArray>(initializer);
+        RELEASE_ASSERT(init_str, "");
+
+        StringRef s = init_str->getAsString();
+        char* newdata = new char[s.size()];
+        memcpy(newdata, s.data(), s.size());
+        address = (intptr_t)newdata;
+    } else {
+        address = (intptr_t)findAddressForName(gv->getName());
+    }
+
+    global_addresses[gv] = address;
+    return address;
+}
+
+// Bump allocator for the memory the interpreter hands out while running
+// something (shadow allocas and va_list buffers).
+// There is one per recording or resumed exit, and it all gets freed together
+// once that is done.
+class Arena {
+private:
+    static const size_t chunk_size = 64 * 1024;
+
+    vector<char*> chunks;
+    char* cur = nullptr;
+    char* end = nullptr;
+
+public:
+    Arena() {}
+    Arena(const Arena&) = delete;
+    ~Arena() {
+        for (auto chunk : chunks)
+            free(chunk);
+    }
+
+    void* allocate(size_t bytes) {
+        // malloc'd chunks are 16-byte aligned, so keep every allocation so
+        bytes = (max(bytes, (size_t)1) + 15) & ~(size_t)15;
+
+        if (bytes > end - cur) {
+            // Big allocations get their own chunk rather than wasting the
+            // rest of the current one
+            if (bytes > chunk_size / 4) {
+                char* big = (char*)malloc(bytes);
+                RELEASE_ASSERT(big, "");
+                chunks.push_back(big);
+                return big;
+            }
+
+            cur = (char*)malloc(chunk_size);
+            RELEASE_ASSERT(cur, "");
+            end = cur + chunk_size;
+            chunks.push_back(cur);
+        }
+
+        void* r = cur;
+        cur += bytes;
+        return r;
+    }
 };
 
 class RuntimeValue {
@@ -139,362 +365,90 @@ class Interpreter {
 private:
     Jit& jit;
 
-    class RealValue;
-    class Value {
-    public:
-        virtual ~Value() {}
-        virtual shared_ptr<RealValue> getAsRealValue(Interpreter& interpreter,
-                                                     shared_ptr<Value> self)
-            = 0;
-
-        virtual shared_ptr<Value> call(Interpreter& interpreter,
-                                       const vector<shared_ptr<Value>>& args,
-                                       const CallInst* orig_inst) = 0;
-
-        virtual void store(Interpreter& interpreter, shared_ptr<Value> val,
-                           long size) = 0;
-    };
-
-    class RealValue : public Value {
-    public:
+    // What the interpreter knows about a value: what it is right now, and
+    // how the trace computes it.  Plain data, so that frames keep them
+    // directly in their slots.
+    struct RealValue {
         RuntimeValue runtime_value;
         typename Jit::Value jit_value;
 
+        RealValue() : jit_value(nullptr) {}
         RealValue(RuntimeValue runtime_value, typename Jit::Value jit_value)
             : runtime_value(runtime_value), jit_value(jit_value) {}
-
-        shared_ptr<RealValue> getAsRealValue(Interpreter& interpreter,
-                                             shared_ptr<Value> self) {
-            return static_pointer_cast<RealValue>(self);
-        }
-
-        shared_ptr<Value> call(Interpreter& interpreter,
-                               const vector<shared_ptr<Value>>& args,
-                               const CallInst* orig_inst) {
-            long addr = interpreter.getAsConstInt(this);
-
-            if (!TraceStrategy().shouldntTrace((void*)addr)) {
-                const Function* function = functionForAddress(addr);
-                RELEASE_ASSERT(function, "not a function?");
-
-                if (TraceStrategy().shouldTraceInto(function->getName())) {
-                    vector<shared_ptr<Value>> new_args;
-
-                    interpreter.jit.startScope();
-
-                    auto arg_it = function->arg_begin();
-                    int i = 0;
-                    while (arg_it != function->arg_end()) {
-                        auto rarg
-                            = args[i]->getAsRealValue(interpreter, args[i]);
-
-                        if (rarg->jit_value->getType() != arg_it->getType())
-                            rarg = make_shared<RealValue>(
-                                rarg->runtime_value,
-                                interpreter.jit.bitcast(rarg->jit_value,
-                                                        arg_it->getType()));
-                        new_args.push_back(rarg);
-
-                        // TODO this is wrong:
-                        interpreter.jit.map(arg_it, rarg->jit_value);
-
-                        i++;
-                        arg_it++;
-                    }
-                    while (i < args.size()) {
-                        new_args.push_back(args[i]);
-                        i++;
-                    }
-
-                    auto r = interpreter.interpret(interpreter.jit, function,
-                                                   new_args);
-
-                    interpreter.jit.endScope();
-
-                    // Kind of a hack but maybe not really: Types don't need to
-                    // perfectly align across translation units, so we might
-                    // have received an object that was of a (similar but)
-                    // different type.
-                    if (r->jit_value
-                        && r->jit_value->getType() != orig_inst->getType()) {
-                        auto new_jitval = interpreter.jit.bitcast(
-                            r->jit_value, orig_inst->getType());
-                        r = make_shared<RealValue>(r->runtime_value,
-                                                   new_jitval);
-                    }
-
-                    interpreter.jit.map(orig_inst, r->jit_value);
-                    return r;
-                }
-            }
-
-            vector<shared_ptr<RealValue>> real_args;
-            for (auto arg : args) {
-                real_args.push_back(arg->getAsRealValue(interpreter, arg));
-            }
-
-            // TODO: handle floating point stuff here
-            long result;
-            if (args.size() == 1) {
-                auto ptr = (long (*)(long))addr;
-                result = (*ptr)(real_args[0]->runtime_value.getData());
-            } else if (args.size() == 2) {
-                auto ptr = (long (*)(long, long))addr;
-                result = (*ptr)(real_args[0]->runtime_value.getData(),
-                                real_args[1]->runtime_value.getData());
-            } else if (args.size() == 3) {
-                auto ptr = (long (*)(long, long, long))addr;
-                result = (*ptr)(real_args[0]->runtime_value.getData(),
-                                real_args[1]->runtime_value.getData(),
-                                real_args[2]->runtime_value.getData());
-            } else if (args.size() == 4) {
-                auto ptr = (long (*)(long, long, long, long))addr;
-                result = (*ptr)(real_args[0]->runtime_value.getData(),
-                                real_args[1]->runtime_value.getData(),
-                                real_args[2]->runtime_value.getData(),
-                                real_args[3]->runtime_value.getData());
-            } else if (args.size() == 5) {
-                auto ptr = (long (*)(long, long, long, long, long))addr;
-                result = (*ptr)(real_args[0]->runtime_value.getData(),
-                                real_args[1]->runtime_value.getData(),
-                                real_args[2]->runtime_value.getData(),
-                                real_args[3]->runtime_value.getData(),
-                                real_args[4]->runtime_value.getData());
-            } else if (args.size() == 6) {
-                auto ptr = (long (*)(long, long, long, long, long, long))addr;
-                result = (*ptr)(real_args[0]->runtime_value.getData(),
-                                real_args[1]->runtime_value.getData(),
-                                real_args[2]->runtime_value.getData(),
-                                real_args[3]->runtime_value.getData(),
-                                real_args[4]->runtime_value.getData(),
-                                real_args[5]->runtime_value.getData());
-            } else if (args.size() == 7) {
-                auto ptr
-                    = (long (*)(long, long, long, long, long, long, long))addr;
-                result = (*ptr)(real_args[0]->runtime_value.getData(),
-                                real_args[1]->runtime_value.getData(),
-                                real_args[2]->runtime_value.getData(),
-                                real_args[3]->runtime_value.getData(),
-                                real_args[4]->runtime_value.getData(),
-                                real_args[5]->runtime_value.getData(),
-                                real_args[6]->runtime_value.getData());
-            } else if (args.size() == 8) {
-                auto ptr = (long (*)(long, long, long, long, long, long, long,
-                                     long))addr;
-                result = (*ptr)(real_args[0]->runtime_value.getData(),
-                                real_args[1]->runtime_value.getData(),
-                                real_args[2]->runtime_value.getData(),
-                                real_args[3]->runtime_value.getData(),
-                                real_args[4]->runtime_value.getData(),
-                                real_args[5]->runtime_value.getData(),
-                                real_args[6]->runtime_value.getData(),
-                                real_args[7]->runtime_value.getData());
-            } else {
-                RELEASE_ASSERT(0, "%ld", args.size());
-            }
-
-            //vector<typename Jit::Value> jit_args;
-            //for (auto& arg : real_args) {
-                //jit_args.push_back(arg->jit_value);
-            //}
-            //auto jit_result = interpreter.jit.call(jit_value, jit_args);
-            auto func = orig_inst->getCalledFunction();
-            if (func)
-                interpreter.jit.addFunction(func);
-            auto jit_result = interpreter.jit.addInst(orig_inst);
-            return make_shared<RealValue>(result, jit_result);
-        }
-
-        void store(Interpreter& interpreter, shared_ptr<Value> val, long size) {
-            long ptr_long = interpreter.getAsInt(this);
-            long val_long = interpreter.getAsInt(val);
-
-            long loaded;
-            switch (size) {
-                case 4:
-                    *(int*)ptr_long = val_long;
-                    break;
-                case 8:
-                    *(long*)ptr_long = val_long;
-                    break;
-                default:
-                    RELEASE_ASSERT(0, "unhandled size %ld", size);
-            }
-        }
     };
 
-    class FakeValue : public Value {
-        shared_ptr<RealValue> getAsRealValue(Interpreter& interpreter,
-                                             shared_ptr<Value> self) {
-            RELEASE_ASSERT(0, "not supported");
-        }
-
-        shared_ptr<Value> call(Interpreter& interpreter,
-                               const vector<shared_ptr<Value>>& args,
-                               const CallInst* orig_inst) {
-            RELEASE_ASSERT(0, "not supported");
-        }
-
-        void store(Interpreter& interpreter, shared_ptr<Value> val, long size) {
-            RELEASE_ASSERT(0, "not supported");
-        }
-    };
-
-    class FakePointer : public FakeValue {
-    private:
-        shared_ptr<Value> pointee;
+public:
+    // State shared by all the frames of one recording (or resumed exit)
+    struct Session {
+        Arena arena;
 
-    public:
-        FakePointer(shared_ptr<Value> pointee) : pointee(move(pointee)) {}
+        // A constant evaluates to the same thing every time within a
+        // recording, including the declarations it adds to the trace.
+        unordered_map<const Constant*, RealValue> constants;
 
-        void store(Interpreter& interpreter, shared_ptr<Value> val, long size) {
-            pointee = move(val);
-        }
+        // What the trace being recorded gets evicted with
+        const void* owner = nullptr;
     };
 
-    //class VaList : public FakeValue {
-    //public:
-    //};
-
-    class Intrinsic : public FakeValue {
-    public:
-        enum ID {
-            VaStart,
-            VaEnd,
-        } id;
-
-        Intrinsic(ID id) : id(id) {}
-
-        shared_ptr<Value> call(Interpreter& interpreter,
-                               const vector<shared_ptr<Value>>& args,
-                               const CallInst* orig_inst) {
-            if (id == VaStart) {
-                auto tag = args[0]->getAsRealValue(interpreter, args[0]);
-                long tag_ptr = interpreter.getAsInt(args[0]);
-
-                auto vaargs = interpreter.getVaArgs();
-
-                struct va_list_tag {
-                    int index;
-                    int unknown;
-                    intptr_t* stackptr;
-                    intptr_t* regptr;
-                };
-
-                auto jit_tag_val_bitcast = tag->jit_value;
-                RELEASE_ASSERT(isa<BitCastInst>(jit_tag_val_bitcast), "");
-                auto tag_jit_val
-                    = cast<BitCastInst>(jit_tag_val_bitcast)->getOperand(0);
-
-                va_list_tag* va = (va_list_tag*)tag_ptr;
-                va->index = 0;
-                interpreter.jit.store(
-                    interpreter.jit.constantInt(0, Type::getInt32Ty(context)),
-                    interpreter.jit.gepInBounds(tag_jit_val, { 0, 0, 0 }));
-
-                if (vaargs.size()) {
-                    int nregs = min(6, (int)vaargs.size());
-                    auto allocation = interpreter.allocate(
-                        ArrayType::get(Type::getInt8Ty(context), nregs * 8));
-                    va->regptr = (intptr_t*)allocation->runtime_value.getData();
-                    interpreter.jit.store(
-                        interpreter.jit.gepInBounds(allocation->jit_value,
-                                                    { 0, 0 }),
-                        interpreter.jit.gepInBounds(tag_jit_val, { 0, 0, 3 }));
-                    for (int i = 0; i < nregs; i++) {
-                        auto rarg
-                            = vaargs[i]->getAsRealValue(interpreter, vaargs[i]);
-                        va->regptr[i] = (intptr_t)rarg->runtime_value.getData();
-                        interpreter.jit.store(
-                            rarg->jit_value,
-                            interpreter.jit.bitcast(
-                                interpreter.jit.gepInBounds(
-                                    allocation->jit_value, { 0, 8 * i }),
-                                rarg->jit_value->getType()->getPointerTo()));
-                    }
-                }
-
-                if (vaargs.size() > 6) {
-                    int nstack = vaargs.size() - 6;
-                    auto allocation = interpreter.allocate(
-                        ArrayType::get(Type::getInt8Ty(context), nstack * 8));
-                    va->stackptr
-                        = (intptr_t*)allocation->runtime_value.getData();
-                    interpreter.jit.store(
-                        interpreter.jit.gepInBounds(allocation->jit_value,
-                                                    { 0, 0 }),
-                        interpreter.jit.gepInBounds(tag_jit_val, { 0, 0, 2 }));
-                    for (int i = 0; i < nstack; i++) {
-                        auto rarg = vaargs[i + 6]->getAsRealValue(
-                            interpreter, vaargs[i + 6]);
-                        va->stackptr[i]
-                            = (intptr_t)rarg->runtime_value.getData();
-                        interpreter.jit.store(
-                            rarg->jit_value,
-                            interpreter.jit.bitcast(
-                                interpreter.jit.gepInBounds(
-                                    allocation->jit_value, { 0, 8 * i }),
-                                rarg->jit_value->getType()->getPointerTo()));
-                    }
-                }
-
-                return interpreter.getVoid();
-            }
-
-            if (id == VaEnd) {
-                return interpreter.getVoid();
-            }
+    Interpreter(Jit& jit, Session& session, const Function* function,
+                Interpreter* parent = nullptr)
+        : jit(jit),
+          session(session),
+          function(function),
+          code(bitcode_registry.getDecoded(function)),
+          parent(parent),
+          slots(code->numSlots()) {}
+
+    Session& session;
+    const Function* function;
+    const DecodedFunction* code;
+
+    // The frame this one was inlined into, if any.  Together with cur_pc
+    // this is what a side exit needs to rebuild the call stack.
+    Interpreter* parent;
+    int cur_pc = 0;
+
+    int inlineDepth() {
+        int depth = 0;
+        for (Interpreter* frame = parent; frame; frame = frame->parent)
+            depth++;
+        return depth;
+    }
 
-            RELEASE_ASSERT(0, "%d", id);
+    // How many frames of this function are already on the stack
+    int recursionDepth(const Function* callee) {
+        int depth = 0;
+        for (Interpreter* frame = this; frame; frame = frame->parent) {
+            if (frame->function == callee)
+                depth++;
         }
-    };
-
-    class BlockResult {
-    public:
-        enum Type {
-            Return,
-            Branch
-        } type;
-
-        const BasicBlock* branch_to;
-        shared_ptr<Value> return_value;
-
-        BlockResult(const BasicBlock* branch_to)
-            : type(Branch), branch_to(branch_to) {}
-        BlockResult(shared_ptr<Value> return_value)
-            : type(Return), return_value(move(return_value)) {}
-    };
-
-public:
-    Interpreter(Jit& jit)
-        : jit(jit) {}
+        return depth;
+    }
 
-    vector<unique_ptr<char>> allocations;
-    shared_ptr<RealValue> allocate(long bits, Type* type) {
+    RealValue allocate(long bits, Type* type) {
         RELEASE_ASSERT((bits & 7) == 0, "%ld", bits);
         long bytes = bits / 8;
 
-        char* alloc = new char[bytes];
-        allocations.push_back(unique_ptr<char>(alloc));
-        return make_shared<RealValue>((intptr_t)alloc, jit.alloca(type));
+        void* alloc = session.arena.allocate(bytes);
+        return RealValue((intptr_t)alloc, jit.alloca(type));
     }
 
-    shared_ptr<RealValue> allocate(Type* type) {
+    RealValue allocate(Type* type) {
         return allocate(8 * data_layout->getTypeAllocSize(type), type);
     }
 
-    unordered_map<const llvm::Value*, shared_ptr<Value>> symtable;
-    void setVariable(const llvm::Value* forval, shared_ptr<Value> value) {
-#ifdef VERBOSE
-        //outs() << "Defining " << forval << " " << *forval << '\n';
-#endif
-        symtable[forval] = move(value);
+    // Indexed by the slot numbers from the decoded function
+    vector<RealValue> slots;
+    void setVariable(int slot, const RealValue& value) {
+        slots[slot] = value;
     }
 
+    // Only used for constant expressions; GEP instructions have their
+    // offsets worked out when they get decoded.
     long evalGepOffset(Type* ElemTy, ArrayRef<llvm::Value*> Indices) {
         long Result = 0;
 
-        Result += getAsConstInt(getVal(Indices[0]))
+        Result += getAsInt(getVal(Indices[0]))
                   * data_layout->getTypeAllocSize(ElemTy);
 
         generic_gep_type_iterator<llvm::Value* const*> GTI
@@ -529,47 +483,137 @@ public:
         return Result;
     }
 
-    long getAsConstInt(RealValue* rvalue) {
-        jit.ensureConstant(rvalue->jit_value, rvalue->runtime_value.getData());
-        return rvalue->runtime_value.data;
+    long getAsConstInt(const RealValue& rvalue) {
+        if (jit.isRecording() && rvalue.jit_value
+            && !jit.isConstant(rvalue.jit_value)) {
+            vector<typename Jit::Value> live_values;
+            SideExit* exit = createSideExit(live_values);
+            jit.ensureConstant(rvalue.jit_value, rvalue.runtime_value.getData(),
+                               exit, live_values);
+        }
+        return rvalue.runtime_value.data;
+    }
+
+    SideExit::ExitValue captureValue(int slot, const RealValue& rvalue,
+                                     vector<typename Jit::Value>& live_values) {
+        auto type = rvalue.jit_value->getType();
+        if (!jit.isConstant(rvalue.jit_value)) {
+            live_values.push_back(rvalue.jit_value);
+            return { slot, type, (int)live_values.size() - 1, 0 };
+        }
+        return { slot, type, -1, rvalue.runtime_value.data };
     }
 
-    long getAsConstInt(shared_ptr<Value> value) {
-        auto rvalue = value->getAsRealValue(*this, value);
-        return getAsConstInt(rvalue.get());
+    SideExit::Frame captureFrame(vector<typename Jit::Value>& live_values) {
+        SideExit::Frame frame;
+        frame.function = function;
+        frame.pc = cur_pc;
+        frame.prev_block = prev_block;
+
+        // Slots that aren't defined yet (or hold void) have no jit value
+        for (int i = 0; i < slots.size(); i++) {
+            if (slots[i].jit_value)
+                frame.values.push_back(captureValue(i, slots[i], live_values));
+        }
+
+        for (auto& arg : vaargs)
+            frame.vaargs.push_back(captureValue(-1, arg, live_values));
+
+        return frame;
     }
 
-    long getAsInt(RealValue* rvalue) {
-        return rvalue->runtime_value.data;
+    SideExit* createSideExit(vector<typename Jit::Value>& live_values) {
+        side_exits.emplace_back(new SideExit());
+        SideExit* exit = side_exits.back().get();
+        exit->handler = &sideExit;
+        exit->restartable = false;
+        exit->num_exits = 0;
+        exit->owner = session.owner;
+
+        for (Interpreter* frame = this; frame; frame = frame->parent)
+            exit->frames.push_back(frame->captureFrame(live_values));
+        return exit;
     }
 
-    long getAsInt(shared_ptr<Value> value) {
-        auto rvalue = value->getAsRealValue(*this, value);
-        return getAsInt(rvalue.get());
+    RealValue restoreValue(const SideExit::ExitValue& value,
+                           long* live_values) {
+        if (value.live_index >= 0)
+            return RealValue(RuntimeValue(live_values[value.live_index]),
+                             jit.liveValue(value.live_index, value.type));
+        return RealValue(RuntimeValue(value.constant),
+                         jit.constantInt(value.constant, value.type));
     }
 
-    shared_ptr<RealValue> fromConstInt(long value, Type* type = nullptr) {
+    void restoreFrame(const SideExit::Frame& frame, long* live_values) {
+        prev_block = frame.prev_block;
+        for (auto& value : frame.values) {
+            auto rvalue = restoreValue(value, live_values);
+            jit.map(code->slot_values[value.slot], rvalue.jit_value);
+            setVariable(value.slot, rvalue);
+        }
+        for (auto& value : frame.vaargs)
+            vaargs.push_back(restoreValue(value, live_values));
+    }
+
+    RealValue returnFromInlinedCall(const CallInst* orig_inst, RealValue r) {
+        // Kind of a hack but maybe not really: Types don't need to
+        // perfectly align across translation units, so we might
+        // have received an object that was of a (similar but)
+        // different type.
+        if (r.jit_value && r.jit_value->getType() != orig_inst->getType())
+            r.jit_value = jit.bitcast(r.jit_value, orig_inst->getType());
+
+        jit.map(orig_inst, r.jit_value);
+        return r;
+    }
+
+    long getAsInt(const RealValue& rvalue) {
+        return rvalue.runtime_value.data;
+    }
+
+    RealValue fromConstInt(long value, Type* type = nullptr) {
         if (!type)
             type = Type::getInt64Ty(context);
-        return make_shared<RealValue>(RuntimeValue(value),
-                                      jit.constantInt(value, type));
+        return RealValue(RuntimeValue(value), jit.constantInt(value, type));
     }
 
-    shared_ptr<RealValue> getVoid() {
-        return make_shared<RealValue>(RuntimeValue(0L), nullptr);
+    RealValue getVoid() {
+        return RealValue(RuntimeValue(0L), nullptr);
     }
 
 
-    vector<shared_ptr<Value>> vaargs;
-    void setVaArgs(vector<shared_ptr<Value>> args) {
-        vaargs = args;
+    vector<RealValue> vaargs;
+    void setVaArgs(vector<RealValue> args) {
+        vaargs = move(args);
     }
 
-    vector<shared_ptr<Value>> getVaArgs() {
-        return vaargs;
+    RealValue evalConstant(const Constant* val) {
+        auto it = session.constants.find(val);
+        if (it != session.constants.end()) {
+            remapGlobals(val, it->second);
+            return it->second;
+        }
+
+        RealValue r = computeConstant(val);
+        session.constants[val] = r;
+        return r;
     }
 
-    shared_ptr<Value> evalConstant(const Constant* val) {
+    // The trace's copy of a global only gets mapped in the scope that first
+    // used it, and every traced call has a scope of its own, so a constant
+    // that comes from the cache has its globals mapped again.
+    void remapGlobals(const Constant* val, const RealValue& cached) {
+        if (auto gv = dyn_cast<GlobalVariable>(val)) {
+            if (cached.jit_value)
+                jit.map(gv, cached.jit_value);
+        } else if (auto expr = dyn_cast<ConstantExpr>(val)) {
+            // Only GEPs get here, and their base is the only operand that
+            // computeConstant evaluates
+            evalConstant(expr->getOperand(0));
+        }
+    }
+
+    RealValue computeConstant(const Constant* val) {
         if (isa<ConstantExpr>(val)) {
             auto expr = cast<ConstantExpr>(val);
             auto opcode = expr->getOpcode();
@@ -595,11 +639,13 @@ public:
 
                 auto base = expr->getOperand(0);
                 // Not sure why value remapping doesn't catch this:
-                if (isa<GlobalVariable>(base))
-                    base = jit.addGlobal(cast<GlobalVariable>(base));
-                auto jit_val
-                    = ConstantExpr::getGetElementPtr(t, base, gep_operands);
-                return make_shared<RealValue>(curptr, jit_val);
+                if (auto gv = dyn_cast<GlobalVariable>(base))
+                    base = jit.addGlobal(gv, globalAddress(gv));
+                typename Jit::Value jit_val = nullptr;
+                if (base)
+                    jit_val
+                        = ConstantExpr::getGetElementPtr(t, base, gep_operands);
+                return RealValue(curptr, jit_val);
             }
 
             RELEASE_ASSERT(0, "unhandled opcode %d %s", opcode,
@@ -616,42 +662,17 @@ public:
         if (isa<GlobalVariable>(val)) {
             auto gv = cast<GlobalVariable>(val);
 
-            auto jit_val = jit.addGlobal(gv);
-
-            auto arr_type = dyn_cast<ArrayType>(
-                cast<PointerType>(gv->getType())->getElementType());
-            if (arr_type && arr_type->getElementType()->isIntegerTy(8)) {
-                RELEASE_ASSERT(gv->isConstant(), "");
-
-                auto initializer = gv->getInitializer();
-                RELEASE_ASSERT(initializer, "");
-
-                auto init_str = dyn_cast<ConstantDataArray>(initializer);
-                RELEASE_ASSERT(init_str, "");
-
-                StringRef s = init_str->getAsString();
-                char* newdata = new char[s.size()];
-                memcpy(newdata, s.data(), s.size());
-
-                allocations.push_back(unique_ptr<char>(newdata));
-                return make_shared<RealValue>((intptr_t)newdata, jit_val);
-            }
-
-            return make_shared<RealValue>(
-                (intptr_t)findAddressForName(val->getName()), jit_val);
+            long address = globalAddress(gv);
+            auto jit_val = jit.addGlobal(gv, address);
+            return RealValue(address, jit_val);
         }
 
         if (isa<Function>(val)) {
-            auto func = cast<Function>(val);
-            if (func->getName() == "llvm.va_start")
-                return make_shared<Intrinsic>(Intrinsic::VaStart);
-            if (func->getName() == "llvm.va_end")
-                return make_shared<Intrinsic>(Intrinsic::VaEnd);
-            return fromConstInt((long)findAddressForName(func->getName()));
+            return fromConstInt(globalAddress(cast<Function>(val)));
         }
 
         if (isa<ConstantPointerNull>(val)) {
-            return make_shared<RealValue>(
+            return RealValue(
                 RuntimeValue(0L),
                 ConstantPointerNull::get(cast<PointerType>(val->getType())));
         }
@@ -660,437 +681,652 @@ public:
         RELEASE_ASSERT(0, "unhandled constant");
     }
 
-    const BasicBlock* prev_bb = nullptr;
-    void setPrevBlock(const BasicBlock* bb) {
-        prev_bb = bb;
+    // The target of a function that is hot enough to have been compiled on
+    // its own, if the call can go to it.  Calling its trace shares it
+    // instead of copying it into every trace that calls the function.  The
+    // target being recorded is still TRACING, so recursion gets inlined as
+    // before.
+    JitTarget* hotTarget(long addr, const Function* function,
+                         const CallInst* orig_inst,
+                         const vector<RealValue>& args) {
+        auto it = jit_targets.find((void*)addr);
+        if (it == jit_targets.end())
+            return nullptr;
+        JitTarget* target = it->second;
+        auto state = __atomic_load_n(&target->state, __ATOMIC_ACQUIRE);
+        if (state != JIT_TARGET_COMPILING && state != JIT_TARGET_READY)
+            return nullptr;
+
+        // Until the trace is there the call goes through _runJitTarget,
+        // which only handles integers and pointers.
+        if (function->isVarArg()
+            || orig_inst->getFunctionType() != function->getFunctionType()
+            || args.size() != target->num_args)
+            return nullptr;
+        auto fitsLong = [](Type* type) {
+            return type->isIntegerTy() || type->isPointerTy();
+        };
+        auto return_type = function->getReturnType();
+        if (!return_type->isVoidTy() && !fitsLong(return_type))
+            return nullptr;
+        for (auto& arg : args) {
+            if (!arg.jit_value || !fitsLong(arg.jit_value->getType()))
+                return nullptr;
+        }
+        return target;
     }
 
-    shared_ptr<Value> getVal(const llvm::Value* val) {
-        if (isa<Constant>(val)) {
-            return evalConstant(cast<Constant>(val));
-        }
+    RealValue call(const RealValue& callee, const vector<RealValue>& args,
+                   const CallInst* orig_inst) {
+        long addr = getAsConstInt(callee);
+        JitTarget* callee_target = nullptr;
+
+        // When we aren't recording there is no point in interpreting the
+        // callee; the native version computes the same thing.
+        if (jit.isRecording() && !TraceStrategy().shouldntTrace((void*)addr)) {
+            const Function* function = functionForAddress(addr);
+            RELEASE_ASSERT(function, "not a function?");
+
+            callee_target = hotTarget(addr, function, orig_inst, args);
+            if (!callee_target
+                && TraceStrategy().shouldTraceInto(function->getName())
+                && TraceStrategy().shouldInline(recursionDepth(function),
+                                                inlineDepth(),
+                                                jit.traceSize())) {
+                vector<RealValue> new_args;
+
+                jit.startScope(orig_inst);
+
+                auto arg_it = function->arg_begin();
+                int i = 0;
+                while (arg_it != function->arg_end()) {
+                    RealValue rarg = args[i];
+
+                    if (rarg.jit_value
+                        && rarg.jit_value->getType() != arg_it->getType())
+                        rarg.jit_value
+                            = jit.bitcast(rarg.jit_value, arg_it->getType());
+                    new_args.push_back(rarg);
+
+                    // TODO this is wrong:
+                    jit.map(arg_it, rarg.jit_value);
+
+                    i++;
+                    arg_it++;
+                }
+                while (i < args.size()) {
+                    new_args.push_back(args[i]);
+                    i++;
+                }
 
-        //outs() << val << " " << *val << '\n';
-        RELEASE_ASSERT(symtable.count(val), "");
-        return symtable[val];
-    }
+                auto r = interpret(jit, session, function, new_args, this);
 
-    BlockResult interpret(const BasicBlock& bb) {
-        for (auto& instr : bb) {
-#ifdef VERBOSE
-            outs() << "Interpreting " << instr << '\n';
-#endif
+                jit.endScope();
 
-            if (isa<CmpInst>(instr)) {
-                auto& cmp = cast<CmpInst>(instr);
-                auto pred = cmp.getPredicate();
-
-                RELEASE_ASSERT(
-                    data_layout->getTypeSizeInBits(cmp.getOperand(0)->getType())
-                        == data_layout->getTypeSizeInBits(
-                               cmp.getOperand(1)->getType()),
-                    "");
-                int bits = data_layout->getTypeSizeInBits(
-                    cmp.getOperand(0)->getType());
-
-                auto lhs = getVal(instr.getOperand(0));
-                auto rhs = getVal(instr.getOperand(1));
-
-                long lhs_val = getAsInt(lhs);
-                long rhs_val = getAsInt(rhs);
-
-                bool result;
-                switch (pred) {
-                    case CmpInst::ICMP_ULT:
-                        switch (bits) {
-                            case 64:
-                                result = (unsigned long)lhs_val
-                                         < (unsigned long)rhs_val;
-                                break;
-                            case 32:
-                                result = (unsigned int)lhs_val
-                                         < (unsigned int)rhs_val;
-                                break;
-                            default:
-                                RELEASE_ASSERT(0, "unhandled size %d", bits);
-                        }
-                        break;
-                    case CmpInst::ICMP_SLT:
-                        switch (bits) {
-                            case 64:
-                                result = (long)lhs_val < (long)rhs_val;
-                                break;
-                            case 32:
-                                result = (int)lhs_val < (int)rhs_val;
-                                break;
-                            default:
-                                RELEASE_ASSERT(0, "unhandled size %d", bits);
-                        }
-                        break;
-                    case CmpInst::ICMP_UGT:
-                        switch (bits) {
-                            case 64:
-                                result = (unsigned long)lhs_val
-                                         > (unsigned long)rhs_val;
-                                break;
-                            case 32:
-                                result = (unsigned int)lhs_val
-                                         > (unsigned int)rhs_val;
-                                break;
-                            default:
-                                RELEASE_ASSERT(0, "unhandled size %d", bits);
-                        }
-                        break;
-                    case CmpInst::ICMP_SGT:
-                        switch (bits) {
-                            case 64:
-                                result = (long)lhs_val > (long)rhs_val;
-                                break;
-                            case 32:
-                                result = (int)lhs_val > (int)rhs_val;
-                                break;
-                            default:
-                                RELEASE_ASSERT(0, "unhandled size %d", bits);
-                        }
-                        break;
-                    case CmpInst::ICMP_EQ:
-                        switch (bits) {
-                            case 64:
-                                result = (long)lhs_val == (long)rhs_val;
-                                break;
-                            case 32:
-                                result = (int)lhs_val == (int)rhs_val;
-                                break;
-                            case 8:
-                                result = (char)lhs_val == (char)rhs_val;
-                                break;
-                            default:
-                                RELEASE_ASSERT(0, "unhandled size %d", bits);
-                        }
-                        break;
-                    case CmpInst::ICMP_NE:
-                        switch (bits) {
-                            case 64:
-                                result = (long)lhs_val != (long)rhs_val;
-                                break;
-                            case 32:
-                                result = (int)lhs_val != (int)rhs_val;
-                                break;
-                            case 8:
-                                result = (char)lhs_val != (char)rhs_val;
-                                break;
-                            default:
-                                RELEASE_ASSERT(0, "unhandled size %d", bits);
-                        }
-                        break;
-                    default:
-                        RELEASE_ASSERT(0, "unhandled predicate %d", pred);
-                };
+                return returnFromInlinedCall(orig_inst, r);
+            }
+        }
 
-                typename Jit::Value jit_val = jit.addInst(&instr);
-                setVariable(&instr, make_shared<RealValue>(result, jit_val));
-                continue;
+        vector<long> arg_vals;
+        for (auto& arg : args) {
+            arg_vals.push_back(arg.runtime_value.getData());
+        }
+        long result = callFunction(addr, arg_vals);
+
+        if (callee_target) {
+            vector<typename Jit::Value> jit_args;
+            auto param_types = orig_inst->getFunctionType()->params();
+            for (int i = 0; i < args.size(); i++) {
+                auto jit_arg = args[i].jit_value;
+                if (jit_arg->getType() != param_types[i])
+                    jit_arg = jit.bitcast(jit_arg, param_types[i]);
+                jit_args.push_back(jit_arg);
             }
+            auto jit_result = jit.callTrace(
+                orig_inst, jit_args, &callee_target->jitted_trace,
+                (void*)&_runJitTarget, callee_target);
+            return RealValue(result, jit_result);
+        }
 
-            if (isa<BinaryOperator>(instr)) {
-                const BinaryOperator& binop = cast<BinaryOperator>(instr);
-                auto opcode = binop.getOpcode();
+        //vector<typename Jit::Value> jit_args;
+        //for (auto& arg : args) {
+            //jit_args.push_back(arg.jit_value);
+        //}
+        //auto jit_result = jit.call(jit_value, jit_args);
+        auto func = orig_inst->getCalledFunction();
+        if (func)
+            jit.addFunction(func, addr);
+        auto jit_result = jit.addInst(orig_inst);
+        return RealValue(result, jit_result);
+    }
 
-                auto lhs = getVal(instr.getOperand(0));
-                auto rhs = getVal(instr.getOperand(1));
+    void store(const RealValue& pointer, const RealValue& val, long size) {
+        long ptr_long = getAsInt(pointer);
+        long val_long = getAsInt(val);
+
+        switch (size) {
+            case 4:
+                *(int*)ptr_long = val_long;
+                break;
+            case 8:
+                *(long*)ptr_long = val_long;
+                break;
+            default:
+                RELEASE_ASSERT(0, "unhandled size %ld", size);
+        }
+    }
 
-                //auto rlhs = lhs->getAsRealValue(*this, lhs);
-                //auto rrhs = rhs->getAsRealValue(*this, rhs);
-                long lhs_val = getAsInt(lhs);
-                long rhs_val = getAsInt(rhs);
+    // Emits the store of one 8-byte va_list slot.
+    void storeVaSlot(const RealValue& allocation, int i, const RealValue& arg) {
+        if (!arg.jit_value)
+            return;
+        jit.store(arg.jit_value,
+                  jit.bitcast(jit.gepInBounds(allocation.jit_value,
+                                              { 0, 8 * i }),
+                              arg.jit_value->getType()->getPointerTo()));
+    }
 
-                int lbits = data_layout->getTypeSizeInBits(
-                    instr.getOperand(0)->getType());
+    void vaStart(const RealValue& tag) {
+        long tag_ptr = getAsInt(tag);
 
-                long rval;
-                switch (opcode) {
-                case BinaryOperator::Add:
-                    rval = lhs_val + rhs_val;
-                    break;
-                case BinaryOperator::Sub:
-                    rval = lhs_val - rhs_val;
-                    break;
-                case BinaryOperator::Mul:
-                    rval = lhs_val * rhs_val;
-                    break;
-                case BinaryOperator::And:
-                    rval = lhs_val & rhs_val;
-                    break;
-                case BinaryOperator::Or:
-                    rval = lhs_val | rhs_val;
-                    break;
-                case BinaryOperator::Shl:
-                    rval = lhs_val << rhs_val;
-                    break;
-                case BinaryOperator::AShr:
-                    switch (lbits) {
-                    case 64:
-                        rval = (unsigned long)lhs_val >> rhs_val;
-                        break;
-                    default:
-                        RELEASE_ASSERT(0, "%d", lbits);
-                    }
-                    break;
-                default:
-                    RELEASE_ASSERT(0, "Unhandled binop code %d", opcode);
-                }
+        struct va_list_tag {
+            int index;
+            int unknown;
+            intptr_t* stackptr;
+            intptr_t* regptr;
+        };
+
+        typename Jit::Value tag_jit_val = nullptr;
+        if (auto jit_tag_val_bitcast = tag.jit_value) {
+            RELEASE_ASSERT(isa<BitCastInst>(jit_tag_val_bitcast), "");
+            tag_jit_val = cast<BitCastInst>(jit_tag_val_bitcast)->getOperand(0);
+        }
 
-                typename Jit::Value jit_val = jit.addInst(&instr);
-                setVariable(&instr, make_shared<RealValue>(rval, jit_val));
-                continue;
+        va_list_tag* va = (va_list_tag*)tag_ptr;
+        va->index = 0;
+        jit.store(jit.constantInt(0, Type::getInt32Ty(context)),
+                  jit.gepInBounds(tag_jit_val, { 0, 0, 0 }));
+
+        if (vaargs.size()) {
+            int nregs = min(6, (int)vaargs.size());
+            auto allocation = allocate(
+                ArrayType::get(Type::getInt8Ty(context), nregs * 8));
+            va->regptr = (intptr_t*)allocation.runtime_value.getData();
+            jit.store(jit.gepInBounds(allocation.jit_value, { 0, 0 }),
+                      jit.gepInBounds(tag_jit_val, { 0, 0, 3 }));
+            for (int i = 0; i < nregs; i++) {
+                va->regptr[i] = (intptr_t)vaargs[i].runtime_value.getData();
+                storeVaSlot(allocation, i, vaargs[i]);
             }
+        }
 
-            if (isa<SelectInst>(instr)) {
-                auto& select = cast<SelectInst>(instr);
+        if (vaargs.size() > 6) {
+            int nstack = vaargs.size() - 6;
+            auto allocation = allocate(
+                ArrayType::get(Type::getInt8Ty(context), nstack * 8));
+            va->stackptr = (intptr_t*)allocation.runtime_value.getData();
+            jit.store(jit.gepInBounds(allocation.jit_value, { 0, 0 }),
+                      jit.gepInBounds(tag_jit_val, { 0, 0, 2 }));
+            for (int i = 0; i < nstack; i++) {
+                va->stackptr[i]
+                    = (intptr_t)vaargs[i + 6].runtime_value.getData();
+                storeVaSlot(allocation, i, vaargs[i + 6]);
+            }
+        }
+    }
 
-                auto cond = getVal(select.getCondition());
-                long cond_val = getAsConstInt(cond);
+    int prev_block = -1;
 
-                const llvm::Value* v;
-                if (cond_val)
-                    v = select.getTrueValue();
-                else
-                    v = select.getFalseValue();
+    RealValue getVal(const llvm::Value* val) {
+        RELEASE_ASSERT(isa<Constant>(val), "");
+        return evalConstant(cast<Constant>(val));
+    }
 
-                shared_ptr<Value> result = getVal(v);
-                jit.map(&instr, v);
-                setVariable(&instr, result);
-                continue;
-            }
+    RealValue getOperand(const Operand& op) {
+        if (op.slot < 0)
+            return evalConstant(op.constant);
+        return slots[op.slot];
+    }
 
-            if (isa<GetElementPtrInst>(instr)) {
-                long curptr = getAsInt(getVal(instr.getOperand(0)));
-                long origptr = curptr;
-                Type* tptr = instr.getOperand(0)->getType();
-                RELEASE_ASSERT(tptr->isPointerTy(), "");
-                Type* t = cast<PointerType>(tptr)->getElementType();
+    RealValue getOperand(const DecodedInst& inst, int i) {
+        return getOperand(code->operand(inst, i));
+    }
 
-                vector<llvm::Value*> gep_operands;
-                for (int i = 1; i < instr.getNumOperands(); i++) {
-                    gep_operands.push_back(instr.getOperand(i));
+    // The phi input coming from prev_block
+    const Operand& incomingOperand(const DecodedInst& phi) {
+        for (int i = 0; i < phi.num_edges; i++) {
+            auto& edge = code->edge(phi, i);
+            if (edge.block == prev_block)
+                return code->operands[edge.operand];
+        }
+        RELEASE_ASSERT(0, "uh oh");
+    }
+
+    bool evalICmp(const DecodedInst& inst, long lhs_val, long rhs_val) {
+        int bits = inst.bits;
+        auto pred = (CmpInst::Predicate)inst.subop;
+
+        bool result;
+        switch (pred) {
+            case CmpInst::ICMP_ULT:
+                switch (bits) {
+                    case 64:
+                        result = (unsigned long)lhs_val
+                                 < (unsigned long)rhs_val;
+                        break;
+                    case 32:
+                        result = (unsigned int)lhs_val < (unsigned int)rhs_val;
+                        break;
+                    default:
+                        RELEASE_ASSERT(0, "unhandled size %d", bits);
                 }
-                long offset = evalGepOffset(t, gep_operands);
+                break;
+            case CmpInst::ICMP_SLT:
+                switch (bits) {
+                    case 64:
+                        result = (long)lhs_val < (long)rhs_val;
+                        break;
+                    case 32:
+                        result = (int)lhs_val < (int)rhs_val;
+                        break;
+                    default:
+                        RELEASE_ASSERT(0, "unhandled size %d", bits);
+                }
+                break;
+            case CmpInst::ICMP_UGT:
+                switch (bits) {
+                    case 64:
+                        result = (unsigned long)lhs_val
+                                 > (unsigned long)rhs_val;
+                        break;
+                    case 32:
+                        result = (unsigned int)lhs_val > (unsigned int)rhs_val;
+                        break;
+                    default:
+                        RELEASE_ASSERT(0, "unhandled size %d", bits);
+                }
+                break;
+            case CmpInst::ICMP_SGT:
+                switch (bits) {
+                    case 64:
+                        result = (long)lhs_val > (long)rhs_val;
+                        break;
+                    case 32:
+                        result = (int)lhs_val > (int)rhs_val;
+                        break;
+                    default:
+                        RELEASE_ASSERT(0, "unhandled size %d", bits);
+                }
+                break;
+            case CmpInst::ICMP_EQ:
+                switch (bits) {
+                    case 64:
+                        result = (long)lhs_val == (long)rhs_val;
+                        break;
+                    case 32:
+                        result = (int)lhs_val == (int)rhs_val;
+                        break;
+                    case 8:
+                        result = (char)lhs_val == (char)rhs_val;
+                        break;
+                    default:
+                        RELEASE_ASSERT(0, "unhandled size %d", bits);
+                }
+                break;
+            case CmpInst::ICMP_NE:
+                switch (bits) {
+                    case 64:
+                        result = (long)lhs_val != (long)rhs_val;
+                        break;
+                    case 32:
+                        result = (int)lhs_val != (int)rhs_val;
+                        break;
+                    case 8:
+                        result = (char)lhs_val != (char)rhs_val;
+                        break;
+                    default:
+                        RELEASE_ASSERT(0, "unhandled size %d", bits);
+                }
+                break;
+            default:
+                RELEASE_ASSERT(0, "unhandled predicate %d", pred);
+        };
+        return result;
+    }
 
-                curptr += offset;
+    long evalBinOp(const DecodedInst& inst, long lhs_val, long rhs_val) {
+        auto opcode = (Instruction::BinaryOps)inst.subop;
+
+        long rval;
+        switch (opcode) {
+            case BinaryOperator::Add:
+                rval = lhs_val + rhs_val;
+                break;
+            case BinaryOperator::Sub:
+                rval = lhs_val - rhs_val;
+                break;
+            case BinaryOperator::Mul:
+                rval = lhs_val * rhs_val;
+                break;
+            case BinaryOperator::And:
+                rval = lhs_val & rhs_val;
+                break;
+            case BinaryOperator::Or:
+                rval = lhs_val | rhs_val;
+                break;
+            case BinaryOperator::Shl:
+                rval = lhs_val << rhs_val;
+                break;
+            case BinaryOperator::AShr:
+                switch (inst.bits) {
+                    case 64:
+                        rval = (unsigned long)lhs_val >> rhs_val;
+                        break;
+                    default:
+                        RELEASE_ASSERT(0, "%d", inst.bits);
+                }
+                break;
+            default:
+                RELEASE_ASSERT(0, "Unhandled binop code %d", opcode);
+        }
+        return rval;
+    }
 
-                typename Jit::Value jit_val = jit.addInst(&instr);
-                setVariable(&instr, make_shared<RealValue>(curptr, jit_val));
-                continue;
-            }
+    long evalCast(const DecodedInst& inst, long op_val) {
+        auto opcode = (Instruction::CastOps)inst.subop;
+        int from_bits = inst.bits;
+
+        long rval;
+        switch (opcode) {
+            case Instruction::BitCast:
+                rval = op_val;
+                break;
+            case Instruction::ZExt:
+                if (from_bits == 1) {
+                    RELEASE_ASSERT(op_val == 0 || op_val == 1, "uh oh");
+                    rval = (unsigned long)(unsigned char)op_val;
+                } else if (from_bits == 8) {
+                    rval = (unsigned long)(unsigned char)op_val;
+                } else if (from_bits == 32) {
+                    rval = (unsigned long)(unsigned int)op_val;
+                } else {
+                    RELEASE_ASSERT(0, "%d", from_bits);
+                }
+                break;
+            case Instruction::SExt:
+                if (from_bits == 8) {
+                    rval = (char)op_val;
+                } else if (from_bits == 32) {
+                    rval = (int)op_val;
+                } else {
+                    RELEASE_ASSERT(0, "%d", from_bits);
+                }
+                break;
+            case Instruction::Trunc:
+                rval = op_val;
+                break;
+            default:
+                RELEASE_ASSERT(0, "Unhandled unop code %d", opcode);
+        }
+        return rval;
+    }
 
-            if (isa<LoadInst>(instr)) {
-                auto& load = cast<LoadInst>(instr);
+    long load(long ptr_long, int size) {
+        switch (size) {
+            case 1:
+                return *(char*)ptr_long;
+            case 4:
+                return *(int*)ptr_long;
+            case 8:
+                return *(long*)ptr_long;
+            default:
+                RELEASE_ASSERT(0, "unhandled size %d", size);
+        }
+    }
 
-                auto pointer = getVal(load.getPointerOperand());
-                long ptr_long = getAsInt(pointer);
-                long size = data_layout->getTypeStoreSize(instr.getType());
+    // Runs the decoded instructions starting at pc until the function
+    // returns.
+    RealValue run(int pc) {
+        while (true) {
+            const DecodedInst& inst = code->insts[pc];
+            cur_pc = pc;
+#ifdef VERBOSE
+            outs() << "Interpreting " << *inst.inst << '\n';
+#endif
 
-                long loaded;
-                switch (size) {
-                case 1:
-                    loaded = *(char*)ptr_long;
+            switch (inst.opcode) {
+                case DecodedInst::ICmp: {
+                    bool result = evalICmp(inst, getAsInt(getOperand(inst, 0)),
+                                           getAsInt(getOperand(inst, 1)));
+                    typename Jit::Value jit_val = jit.addInst(inst.inst);
+                    setVariable(inst.slot,
+                                RealValue(result, jit_val));
+                    pc++;
                     break;
-                case 4:
-                    loaded = *(int*)ptr_long;
+                }
+
+                case DecodedInst::BinOp: {
+                    long rval = evalBinOp(inst, getAsInt(getOperand(inst, 0)),
+                                          getAsInt(getOperand(inst, 1)));
+                    typename Jit::Value jit_val = jit.addInst(inst.inst);
+                    setVariable(inst.slot,
+                                RealValue(rval, jit_val));
+                    pc++;
                     break;
-                case 8:
-                    loaded = *(long*)ptr_long;
+                }
+
+                case DecodedInst::Select: {
+                    long cond_val = getAsConstInt(getOperand(inst, 0));
+                    auto& chosen = code->operand(inst, cond_val ? 1 : 2);
+                    jit.map(inst.inst, code->valueOf(chosen));
+                    setVariable(inst.slot, getOperand(chosen));
+                    pc++;
                     break;
-                default:
-                    RELEASE_ASSERT(0, "unhandled size %ld", size);
                 }
-                typename Jit::Value jit_val = jit.addInst(&instr);
-                setVariable(&instr, make_shared<RealValue>(loaded, jit_val));
-                continue;
-            }
 
-            if (isa<StoreInst>(instr)) {
-                auto& store = cast<StoreInst>(instr);
+                case DecodedInst::GEP: {
+                    // The jitted GEP computes the same offset from the real
+                    // indices, so there's no need to specialize on them
+                    // (which would also keep loops that walk an array from
+                    // being closed).
+                    long curptr = getAsInt(getOperand(inst, 0)) + inst.offset;
+                    for (int i = 1; i < inst.num_operands; i++) {
+                        auto& index = code->operand(inst, i);
+                        curptr += getAsInt(getOperand(index)) * index.scale;
+                    }
 
-                auto pointer = getVal(store.getPointerOperand());
-                auto val = getVal(store.getValueOperand());
+                    typename Jit::Value jit_val = jit.addInst(inst.inst);
+                    setVariable(inst.slot,
+                                RealValue(curptr, jit_val));
+                    pc++;
+                    break;
+                }
 
-                long size = data_layout->getTypeStoreSize(
-                    store.getValueOperand()->getType());
+                case DecodedInst::Load: {
+                    long loaded
+                        = load(getAsInt(getOperand(inst, 0)), inst.size);
+                    typename Jit::Value jit_val = jit.addInst(inst.inst);
+                    setVariable(inst.slot,
+                                RealValue(loaded, jit_val));
+                    pc++;
+                    break;
+                }
 
-                pointer->store(*this, val, size);
-                jit.addInst(&instr);
-                continue;
-            }
+                case DecodedInst::Store: {
+                    store(getOperand(inst, 0), getOperand(inst, 1), inst.size);
+                    jit.addInst(inst.inst);
+                    pc++;
+                    break;
+                }
 
-            if (isa<UnaryInstruction>(instr)) {
-                auto& unop = cast<UnaryInstruction>(instr);
-                auto opcode = unop.getOpcode();
+                case DecodedInst::Cast: {
+                    long rval = evalCast(inst, getAsInt(getOperand(inst, 0)));
+                    typename Jit::Value jit_val = jit.addInst(inst.inst);
+                    setVariable(inst.slot,
+                                RealValue(rval, jit_val));
+                    pc++;
+                    break;
+                }
 
-                long from_bits = data_layout->getTypeSizeInBits(
-                    instr.getOperand(0)->getType());
-                long to_bits = data_layout->getTypeSizeInBits(instr.getType());
+                case DecodedInst::Alloca: {
+                    auto& alloca = cast<AllocaInst>(*inst.inst);
+                    auto allocation = allocate(
+                        inst.size, alloca.getType()->getElementType());
+                    setVariable(inst.slot, allocation);
+                    jit.map(inst.inst, allocation.jit_value);
+                    pc++;
+                    break;
+                }
 
-                auto operand = getVal(instr.getOperand(0));
+                case DecodedInst::Call: {
+                    auto func = getOperand(inst, 0);
 
-                long op_val = getAsInt(operand);
+                    vector<RealValue> args;
+                    for (int i = 1; i < inst.num_operands; i++)
+                        args.push_back(getOperand(inst, i));
 
-                long rval;
-                switch (opcode) {
-                case UnaryInstruction::BitCast:
-                    rval = op_val;
-                    break;
-                case UnaryInstruction::ZExt:
-                    if (from_bits == 1) {
-                        RELEASE_ASSERT(op_val == 0 || op_val == 1, "uh oh");
-                        rval = (unsigned long)(unsigned char)op_val;
-                    } else if (from_bits == 8) {
-                        rval = (unsigned long)(unsigned char)op_val;
-                    } else if (from_bits == 32) {
-                        rval = (unsigned long)(unsigned int)op_val;
-                    } else {
-                        RELEASE_ASSERT(0, "%ld", from_bits);
-                    }
+                    auto ret = call(func, args, cast<CallInst>(inst.inst));
+                    if (inst.slot >= 0)
+                        setVariable(inst.slot, ret);
+                    pc++;
                     break;
-                case UnaryInstruction::SExt:
-                    if (from_bits == 8) {
-                        rval = (char)op_val;
-                    } else if (from_bits == 32) {
-                        rval = (int)op_val;
-                    } else {
-                        RELEASE_ASSERT(0, "%ld", from_bits);
-                    }
+                }
+
+                case DecodedInst::VaStart:
+                    vaStart(getOperand(inst, 0));
+                    pc++;
                     break;
-                case UnaryInstruction::Trunc:
-                    rval = op_val;
+
+                case DecodedInst::VaEnd:
+                    pc++;
                     break;
-                case UnaryInstruction::Alloca: {
-#if 0
-                    auto arr_type = dyn_cast<ArrayType>(
-                        cast<PointerType>(instr.getType())->getElementType());
-                    if (arr_type) {
-                        auto struct_type
-                            = dyn_cast<StructType>(arr_type->getElementType());
-                        if (struct_type
-                            && struct_type->getName() == "struct.__va_list_tag") {
-                            setVariable(&instr, make_shared<FakePointer>(
-                                                    fromConstInt(0)));
-                            continue;
-                        }
-                    }
-#endif
 
-                    auto& alloca = cast<AllocaInst>(instr);
-                    auto allocation = allocate(
-                        *alloca.getAllocationSizeInBits(*data_layout),
-                        alloca.getType()->getElementType());
-                    setVariable(&instr, allocation);
-                    jit.map(&instr, allocation->jit_value);
-                    continue;
-                }
-                default:
-                    RELEASE_ASSERT(0, "Unhandled unop code %d", opcode);
+                case DecodedInst::Ret: {
+                    if (!inst.num_operands)
+                        return getVoid();
+                    return getOperand(inst, 0);
                 }
 
-                typename Jit::Value jit_val = jit.addInst(&instr);
-                setVariable(&instr, make_shared<RealValue>(rval, jit_val));
-                continue;
-            }
+                case DecodedInst::Br:
+                    pc = enterBlock(inst, code->edge(inst, 0).block);
+                    break;
 
-            if (isa<CallInst>(instr)) {
-                auto& call = cast<CallInst>(instr);
-
-                if (isa<Function>(call.getCalledValue())) {
-                    auto name = call.getCalledValue()->getName();
-                    if (name == "llvm.dbg.value")
-                        continue;
-                    if (name == "llvm.dbg.declare")
-                        continue;
-                    if (name == "llvm.lifetime.start.p0i8")
-                        continue;
-                    if (name == "llvm.lifetime.end.p0i8")
-                        continue;
-#if 0
-                    if (name == "llvm.va_start") {
-                        getVal(call.getOperand(0))
-                            ->store(*this, make_shared<VaList>(), 0);
-                        continue;
-                    }
-#endif
+                case DecodedInst::CondBr: {
+                    long cond = getAsConstInt(getOperand(inst, 0));
+                    RELEASE_ASSERT((unsigned long)cond <= 1, "");
+                    pc = enterBlock(inst, code->edge(inst, !cond).block);
+                    break;
                 }
 
-                auto func = getVal(call.getCalledValue());
+                case DecodedInst::Switch: {
+                    long cond = getAsConstInt(getOperand(inst, 0));
 
-                vector<shared_ptr<Value>> args;
-                for (auto& use : call.arg_operands()) {
-                    args.push_back(getVal(use));
+                    int target = code->edge(inst, 0).block;
+                    for (int i = 1; i < inst.num_edges; i++) {
+                        if (cond == code->edge(inst, i).case_value) {
+                            target = code->edge(inst, i).block;
+                            break;
+                        }
+                    }
+                    pc = enterBlock(inst, target);
+                    break;
                 }
 
-                auto ret = func->call(*this, args, &call);
-                setVariable(&instr, ret);
-                continue;
-            }
-
-            if (isa<ReturnInst>(instr)) {
-                auto retval = cast<ReturnInst>(instr).getReturnValue();
-                if (!retval)
-                    return BlockResult(getVoid());
-                else
-                    return BlockResult(getVal(retval));
-            }
-
-            if (isa<BranchInst>(instr)) {
-                auto& br = cast<BranchInst>(instr);
-
-                if (br.isUnconditional()) {
-                    return BlockResult(br.getSuccessor(0));
+                case DecodedInst::Phi: {
+                    auto& incoming = incomingOperand(inst);
+                    setVariable(inst.slot, getOperand(incoming));
+                    jit.map(inst.inst, code->valueOf(incoming));
+                    pc++;
+                    break;
                 }
 
-                long cond = getAsConstInt(getVal(br.getCondition()));
-                RELEASE_ASSERT((unsigned long)cond <= 1, "");
-                return BlockResult(br.getSuccessor(!cond));
+                case DecodedInst::Unhandled:
+                    errs() << *inst.inst << '\n';
+                    RELEASE_ASSERT(0, "Unhandled instr");
             }
+        }
+    }
 
-            if (isa<SwitchInst>(instr)) {
-                auto& sw = cast<SwitchInst>(instr);
-
-                long cond = getAsConstInt(getVal(sw.getCondition()));
+    // Returns where to continue after branching to the given block.
+    int enterBlock(const DecodedInst& branch, int block) {
+        prev_block = branch.block;
+        if (jit.isRecording() && code->blocks[block].is_loop_header)
+            return enterLoopHeader(block);
+        return code->blocks[block].start;
+    }
 
-                for (auto case_ : sw.cases()) {
-                    if (cond == case_.getCaseValue()->getSExtValue())
-                        return BlockResult(case_.getCaseSuccessor());
-                }
+    // Loop headers reached in this frame
+    struct LoopState {
+        typename Jit::Block jit_header;
+        vector<pair<const DecodedInst*, typename Jit::Value>> phis;
+        vector<long> entry_values;
+        bool done; // closed, or being unrolled instead
+    };
+    unordered_map<int, LoopState> loops;
+
+    // The first time we reach a loop header, its phis become real phis in
+    // the trace.  The second time, if the iteration we just recorded can be
+    // run again, the trace gets a back edge and recording stops.
+    // Returns where to start interpreting the header.
+    int enterLoopHeader(int block) {
+        const DecodedBlock& header = code->blocks[block];
+        auto it = loops.find(block);
+        if (it != loops.end() && it->second.done)
+            return header.start;
+
+        // Read all incoming values before defining any of the phis
+        vector<RealValue> incoming;
+        for (int pc = header.start; pc < header.first_non_phi; pc++) {
+            auto& phi = code->insts[pc];
+            auto rvalue = getOperand(incomingOperand(phi));
+            if (rvalue.jit_value->getType() != phi.inst->getType())
+                rvalue.jit_value
+                    = jit.bitcast(rvalue.jit_value, phi.inst->getType());
+            incoming.push_back(rvalue);
+        }
 
-                return BlockResult(sw.getDefaultDest());
+        if (it == loops.end()) {
+            LoopState& loop = loops[block];
+            loop.jit_header = jit.startLoopHeader();
+            loop.done = false;
+
+            for (int pc = header.start; pc < header.first_non_phi; pc++) {
+                auto& phi = code->insts[pc];
+                auto& rvalue = incoming[pc - header.start];
+                auto jit_phi = jit.phi(loop.jit_header, rvalue.jit_value);
+                loop.phis.emplace_back(&phi, jit_phi);
+                loop.entry_values.push_back(rvalue.runtime_value.data);
+                jit.map(phi.inst, jit_phi);
+                setVariable(phi.slot, RealValue(
+                                          rvalue.runtime_value, jit_phi));
             }
+            return header.first_non_phi;
+        }
 
-            if (isa<PHINode>(instr)) {
-                auto& phi = cast<PHINode>(instr);
-
-                bool found = false;
-                for (int i = 0; i < phi.getNumIncomingValues(); i++) {
-                    if (prev_bb == phi.getIncomingBlock(i)) {
-                        auto v = phi.getIncomingValue(i);
-                        setVariable(&instr, getVal(v));
-                        jit.map(&instr, v);
-                        found = true;
-                        break;
-                    }
-                }
-                RELEASE_ASSERT(found, "uh oh");
-                continue;
-            }
+        LoopState& loop = it->second;
+        loop.done = true;
 
-            errs() << instr << '\n';
-            RELEASE_ASSERT(0, "Unhandled instr");
+        // If the trace specialized on a value that is different this time
+        // around, the next iteration would just fail a guard.
+        for (int i = 0; i < loop.phis.size(); i++) {
+            if (incoming[i].runtime_value.data != loop.entry_values[i]
+                && jit.isSpecializedOn(loop.jit_header, loop.phis[i].second))
+                return header.start;
         }
-        RELEASE_ASSERT(0, "No terminator??");
+
+        vector<pair<typename Jit::Value, typename Jit::Value>> backedge_values;
+        for (int i = 0; i < loop.phis.size(); i++)
+            backedge_values.emplace_back(loop.phis[i].second,
+                                         incoming[i].jit_value);
+        jit.closeLoop(loop.jit_header, backedge_values);
+        return header.start;
     }
 
-    static shared_ptr<RealValue>
-    interpret(Jit& jit, const Function* function,
-              const vector<shared_ptr<Value>>& args) {
-        Interpreter<Jit> interpreter(jit);
+    static RealValue interpret(Jit& jit, Session& session,
+                               const Function* function,
+                               const vector<RealValue>& args,
+                               Interpreter* parent = nullptr) {
+        Interpreter<Jit> interpreter(jit, session, function, parent);
 
 #ifdef VERBOSE
         // TODO: read the dbg metadata and print out source location
@@ -1099,7 +1335,7 @@ public:
 
         bool is_variadic = function->isVarArg();
         int num_args = function->arg_size();
-        vector<shared_ptr<Value>> vaargs;
+        vector<RealValue> vaargs;
         if (is_variadic) {
             RELEASE_ASSERT(args.size() >= num_args, "");
             for (int i = num_args; i < args.size(); i++)
@@ -1109,51 +1345,151 @@ public:
             RELEASE_ASSERT(args.size() == num_args, "");
         }
 
-        int i = 0;
-        for (auto& arg : function->args()) {
-            interpreter.setVariable(&arg, args[i]);
-            i++;
-        }
+        // Arguments occupy the first slots
+        for (int i = 0; i < num_args; i++)
+            interpreter.setVariable(i, args[i]);
 
-        RELEASE_ASSERT(!function->empty(), "no body??");
+        return interpreter.run(interpreter.code->blocks[0].start);
+    }
 
-        const BasicBlock* bb = &function->getEntryBlock();
-        while (true) {
-            BlockResult r = interpreter.interpret(*bb);
+    // Rebuilds the interpreter frames described by a side exit and runs them
+    // to completion, innermost first.  Each outer frame resumes right after
+    // the call that the frame inside it was executing.
+    static RealValue resume(Jit& jit, Session& session, const SideExit& exit,
+                            long* live_values) {
+        // Built outermost first, so that each frame can point to its parent
+        vector<unique_ptr<Interpreter<Jit>>> frames;
+        for (auto it = exit.frames.rbegin(); it != exit.frames.rend(); ++it) {
+            Interpreter<Jit>* parent
+                = frames.empty() ? nullptr : frames.back().get();
+            if (parent)
+                jit.startScope(parent->code->insts[std::prev(it)->pc].inst);
+            frames.emplace_back(
+                new Interpreter<Jit>(jit, session, it->function, parent));
+            frames.back()->restoreFrame(*it, live_values);
+        }
 
-            if (r.type == BlockResult::Branch) {
-                interpreter.setPrevBlock(bb);
-                bb = r.branch_to;
-            } else {
-                RELEASE_ASSERT(r.type == BlockResult::Return, "");
-                return r.return_value->getAsRealValue(interpreter,
-                                                      r.return_value);
+        RealValue result;
+        for (int i = 0; i < exit.frames.size(); i++) {
+            auto& frame = exit.frames[i];
+            auto& interpreter = *frames[frames.size() - 1 - i];
+
+            int pc = frame.pc;
+            if (i > 0) {
+                jit.endScope();
+                auto& call = interpreter.code->insts[pc];
+                result = interpreter.returnFromInlinedCall(
+                    cast<CallInst>(call.inst), result);
+                if (call.slot >= 0)
+                    interpreter.setVariable(call.slot, result);
+                ++pc;
             }
+            result = interpreter.run(pc);
         }
+        return result;
     }
 
-    static pair<RuntimeValue, void*>
-    interpret(const Function* function, const vector<RuntimeValue>& params) {
+    // Records a trace that picks up where a side exit leaves off.  Once it is
+    // compiled the trace jumps straight into it.
+    static RuntimeValue recordBridge(SideExit* exit, long* live_values) {
+        Jit jit(exit, &context, &getCompiler());
+        Session session;
+        session.owner = exit->owner;
+
+        auto r = resume(jit, session, *exit, live_values);
+
+        jit.finish(r.jit_value,
+                   [exit](void* bridge) {
+                       // Without a bridge the exit keeps going to sideExit
+                       if (!bridge)
+                           return;
+                       __atomic_store_n(&exit->handler,
+                                        (SideExit::Handler)bridge,
+                                        __ATOMIC_RELEASE);
+                   },
+                   &exit->num_exits, exit->owner);
+        jit.endScope();
+        return r.runtime_value;
+    }
+
+    static RuntimeValue interpret(const Function* function,
+                                  const vector<RuntimeValue>& params,
+                                  JitTarget* target) {
         RELEASE_ASSERT(params.size() == function->arg_size(),
                        "not sure which to pass to this next line");
-        static LLVMCompiler compiler;
-        Jit jit(function, &context, &compiler);
+        Jit jit(function, &context, &getCompiler());
+        Session session;
+        session.owner = target;
 
-        vector<shared_ptr<Value>> args;
+        vector<RealValue> args;
         for (int i = 0; i < params.size(); i++) {
-            args.push_back(make_shared<RealValue>(params[i], jit.arg(i)));
+            args.push_back(RealValue(params[i], jit.arg(i)));
         }
 
-        auto r = interpret(jit, function, args);
-
-        auto function_addr = jit.finish(r->jit_value);
+        auto r = interpret(jit, session, function, args);
+
+        target->state = JIT_TARGET_COMPILING;
+        jit.finish(r.jit_value,
+                   [target](void* trace) {
+                       // The code heap is full.  A baseline trace that
+                       // didn't get tiered up stays; otherwise the target
+                       // runs natively from now on.
+                       if (!trace) {
+                           if (!_jitTargetTrace(target))
+                               __atomic_store_n(&target->state,
+                                                JIT_TARGET_BLACKLISTED,
+                                                __ATOMIC_RELEASE);
+                           return;
+                       }
+                       // The trace goes first, so that anyone who sees the
+                       // new state can use it.
+                       __atomic_store_n(&target->jitted_trace, trace,
+                                        __ATOMIC_RELEASE);
+                       __atomic_store_n(&target->state, JIT_TARGET_READY,
+                                        __ATOMIC_RELEASE);
+                   },
+                   &target->call_count, target);
         jit.endScope();
-        return make_pair(move(r->runtime_value), function_addr);
+        return r.runtime_value;
     }
 };
 
-pair<RuntimeValue, void*> interpret(void* function, vector<long> args) {
-    string name = findNameForAddress(function);
+long sideExit(SideExit* exit, long* live_values) {
+    // Also read by the compile threads to decide what to compile first
+    __atomic_add_fetch(&exit->num_exits, 1, __ATOMIC_RELAXED);
+
+    if (TraceStrategy().shouldRecordBridge(exit)) {
+        auto r = Interpreter<LLVMJit>::recordBridge(exit, live_values);
+        llvm::outs() << "Recorded bridge for exit " << exit << '\n';
+        return r.getData();
+    }
+
+    if (exit->restartable) {
+        const SideExit::Frame& root = exit->frames.back();
+        vector<long> args;
+        // Arguments occupy the first slots
+        for (int i = 0; i < root.function->arg_size(); i++) {
+            auto value = find_if(root.values.begin(), root.values.end(),
+                                 [&](const SideExit::ExitValue& v) {
+                                     return v.slot == i;
+                                 });
+            RELEASE_ASSERT(value != root.values.end(), "");
+            args.push_back(value->live_index >= 0
+                               ? live_values[value->live_index]
+                               : value->constant);
+        }
+        return callFunction(
+            (long)findAddressForName(root.function->getName()), args);
+    }
+
+    NullJit jit;
+    Interpreter<NullJit>::Session session;
+    return Interpreter<NullJit>::resume(jit, session, *exit, live_values)
+        .runtime_value.getData();
+}
+
+RuntimeValue interpret(JitTarget* target, vector<long> args) {
+    string name = findNameForAddress(target->target_function);
 
     const Function* func = bitcode_registry.findFunction(name);
 
@@ -1168,19 +1504,22 @@ pair<RuntimeValue, void*> interpret(void* function, vector<long> args) {
         i++;
     }
 
-    auto r = Interpreter<LLVMJit>::interpret(func, params);
-    llvm::outs() << "Return value: " << r.first.type << ' ' << r.first.data
-                 << '\n';
-    llvm::outs() << "Jitted function: " << r.second << '\n';
+    auto r = Interpreter<LLVMJit>::interpret(func, params, target);
+    llvm::outs() << "Return value: " << r.type << ' ' << r.data << '\n';
+    if (getCompiler().isAsync())
+        llvm::outs() << "Compiling in the background\n";
+    else
+        llvm::outs() << "Jitted function: " << target->jitted_trace << '\n';
 
 #if 0
     long jit_result;
     if (args.size() == 0) {
-        jit_result = ((long (*)())r.second)();
+        jit_result = ((long (*)())target->jitted_trace)();
     } else if (args.size() == 1) {
-        jit_result = ((long (*)(long))r.second)(args[0]);
+        jit_result = ((long (*)(long))target->jitted_trace)(args[0]);
     } else if (args.size() == 2) {
-        jit_result = ((long (*)(long, long))r.second)(args[0], args[1]);
+        jit_result = ((long (*)(long, long))target->jitted_trace)(args[0],
+                                                                  args[1]);
     } else {
         RELEASE_ASSERT(0, "%ld", args.size());
     }
@@ -1215,35 +1554,169 @@ void loadBitcode(const char* bitcode_filename) {
     dcop::bitcode_registry.load(bitcode_filename);
 }
 
+static long default_hot_threshold = -1;
+
+void setJitHotThreshold(long threshold) {
+    default_hot_threshold = threshold;
+}
+
+void setJitBridgeThreshold(long threshold) {
+    dcop::bridge_threshold = threshold;
+}
+
 JitTarget* createJitTarget(void* function, int num_args) {
-    return new JitTarget{ function, num_args, nullptr };
+    if (default_hot_threshold == -1) {
+        const char* env = getenv("DPRO_HOT_THRESHOLD");
+        default_hot_threshold = env ? atol(env) : 100;
+    }
+    auto target = new JitTarget{ function, num_args, nullptr, JIT_TARGET_COLD,
+                                 0, default_hot_threshold };
+    dcop::jit_targets.emplace(function, target);
+    return target;
+}
+
+void setJitAsyncCompile(int enabled) {
+    dcop::getCompiler().setAsync(enabled);
+}
+
+void setJitCompileThreads(int num_threads) {
+    dcop::getCompiler().setNumThreads(max(1, num_threads));
+}
+
+void setJitCompileQueueLimit(int max_queued) {
+    dcop::getCompiler().setMaxQueued(max(1, max_queued));
+}
+
+void setJitCompileBatchSize(int max_batch) {
+    dcop::getCompiler().setMaxBatch(max(1, max_batch));
+}
+
+void setJitTierUpThreshold(long threshold) {
+    dcop::getCompiler().setTierUpThreshold(threshold);
+}
+
+void setJitPipeline(const char* pipeline) {
+    dcop::getCompiler().setPipeline(dcop::LLVMCompiler::Optimized, pipeline);
+}
+
+void setJitBaselinePipeline(const char* pipeline) {
+    dcop::getCompiler().setPipeline(dcop::LLVMCompiler::Baseline, pipeline);
+}
+
+void setJitTimePasses(int enabled) {
+    dcop::getCompiler().setTimePasses(enabled);
+}
+
+void setJitBindSymbols(int enabled) {
+    dcop::getCompiler().setBindSymbols(enabled);
+}
+
+void setJitPerfMap(int enabled) {
+    dcop::getCompiler().setPerfMap(enabled);
+}
+
+void setJitDumpDir(const char* dir) {
+    dcop::getCompiler().setJitDumpDir(dir);
 }
 
+void setJitDebugInfo(int enabled) {
+    dcop::getCompiler().setDebugInfo(enabled);
+}
+
+void setJitObjectCache(const char* dir) {
+    dcop::getCompiler().setCacheDir(dir);
+}
+
+JitCompileStats getJitCompileStats() {
+    auto& compiler = dcop::getCompiler();
+    auto& heap = dcop::CodeHeap::get();
+    return JitCompileStats{ compiler.numPending(), compiler.numCompleted(),
+                            compiler.numCacheHits(),
+                            (long)heap.bytesReserved(),
+                            (long)heap.bytesInUse(),
+                            compiler.targetCPU().c_str() };
+}
+
+void waitForJitCompiles() {
+    dcop::getCompiler().waitForCompiles();
+}
+
+void evictJitTarget(JitTarget* target) {
+    RELEASE_ASSERT(target->state != JIT_TARGET_TRACING,
+                   "can't evict a target while it's being recorded");
+
+    // Unpublished before anything gets freed, so that nothing picks up the
+    // old trace on its way out.  A compile that is still running would
+    // publish it again, so those get to finish first.
+    auto& compiler = dcop::getCompiler();
+    compiler.waitForCompiles();
+    __atomic_store_n(&target->jitted_trace, nullptr, __ATOMIC_RELEASE);
+    // A blacklisted target would just fail to trace again
+    if (target->state != JIT_TARGET_BLACKLISTED) {
+        target->call_count = 0;
+        __atomic_store_n(&target->state, JIT_TARGET_COLD, __ATOMIC_RELEASE);
+    }
+
+    compiler.evict(target);
+
+    auto& exits = dcop::side_exits;
+    exits.erase(std::remove_if(exits.begin(), exits.end(),
+                               [target](const unique_ptr<dcop::SideExit>& e) {
+                                   return e->owner == target;
+                               }),
+                exits.end());
+}
+
+// Set while any target is being recorded; recordings don't nest.
+static bool recording_active = false;
+
 long _runJitTarget(JitTarget* target, ...) {
     va_list vl;
     va_start(vl, target);
 
-    if (target->jitted_trace) {
-        switch (target->num_args) {
-        case 0:
-            return ((long (*)())target->jitted_trace)();
-        case 1:
-            return ((long (*)(long))target->jitted_trace)(va_arg(vl, long));
-        case 2:
-            return ((long (*)(long, long))target->jitted_trace)(va_arg(vl, long), va_arg(vl, long));
-        default:
-            RELEASE_ASSERT(0, "%d", target->num_args);
-        }
-    }
-
     vector<long> args;
     for (int i = 0; i < target->num_args; i++) {
         args.push_back(va_arg(vl, long));
     }
     va_end(vl);
 
-    auto r = dcop::interpret(target->target_function, args);
-    target->jitted_trace = r.second;
-    return r.first.getData();
+    if (void* trace = _jitTargetTrace(target))
+        return dcop::callFunction((long)trace, args);
+
+    // Only the compile thread changes the state behind our back, and only
+    // from COMPILING to READY.
+    switch (__atomic_load_n(&target->state, __ATOMIC_ACQUIRE)) {
+        case JIT_TARGET_COLD:
+            if (++target->call_count < target->hot_threshold)
+                break;
+            if (!dcop::canTrace(target->target_function)) {
+                target->state = JIT_TARGET_BLACKLISTED;
+                break;
+            }
+            target->state = JIT_TARGET_COUNTING;
+            // fall through
+        case JIT_TARGET_COUNTING:
+            if (recording_active)
+                break;
+
+            target->state = JIT_TARGET_TRACING;
+            recording_active = true;
+            {
+                // Sets the state to COMPILING, and to READY once the trace
+                // is available
+                auto r = dcop::interpret(target, args);
+                recording_active = false;
+                return r.getData();
+            }
+        case JIT_TARGET_COMPILING:
+            // Keeps counting so that the compile threads can tell which
+            // targets are the hottest
+            __atomic_add_fetch(&target->call_count, 1, __ATOMIC_RELAXED);
+            break;
+        default:
+            break;
+    }
+
+    return dcop::callFunction((long)target->target_function, args);
 }
 }
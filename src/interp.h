@@ -7,37 +7,172 @@ extern "C" {
 
 void loadBitcode(const char* llvm_filename);
 
+typedef enum {
+    JIT_TARGET_COLD,        // counting calls inline, running natively
+    JIT_TARGET_COUNTING,    // hot, but waiting for another recording to end
+    JIT_TARGET_TRACING,     // being recorded; reentrant calls run natively
+    JIT_TARGET_COMPILING,   // recorded, waiting for its code
+    JIT_TARGET_READY,       // jitted_trace is set
+    JIT_TARGET_BLACKLISTED, // can't be traced, or the code heap was full
+} JitTargetState;
+
 typedef struct _JitTarget {
     void* target_function;
     int num_args;
 
     void* jitted_trace;
+
+    JitTargetState state;
+    long call_count;
+    long hot_threshold;
 } JitTarget;
 
+// Number of calls after which targets get traced.  Applies to targets created
+// afterwards; the default can also be set with the DPRO_HOT_THRESHOLD
+// environment variable.
+void setJitHotThreshold(long threshold);
+
+// Number of times a side exit has to be taken before a bridge trace gets
+// recorded from it.  Defaults to 10, or DPRO_BRIDGE_THRESHOLD.
+void setJitBridgeThreshold(long threshold);
+
+// Once the first target created for a function has been compiled, traces
+// that call the function call its trace instead of tracing into it.
 JitTarget* createJitTarget(void* target_function, int num_args);
 long _runJitTarget(JitTarget* target, ...);
 
+// Compile traces on a background thread instead of in the call that finished
+// recording them; until its trace is ready a target keeps running natively.
+// Can also be turned on by setting DPRO_ASYNC_COMPILE=1.
+void setJitAsyncCompile(int enabled);
+
+// Number of background compile threads; defaults to one less than the number
+// of cores, or DPRO_COMPILE_THREADS.  Has to be set before the first
+// asynchronous compile.  Pending compiles go hottest target first.
+void setJitCompileThreads(int num_threads);
+// Recording blocks once this many traces are waiting to be compiled.
+void setJitCompileQueueLimit(int max_queued);
+// Traces that are waiting to be compiled at the same time get compiled
+// together, up to this many at once (16 by default, or DPRO_COMPILE_BATCH).
+void setJitCompileBatchSize(int max_batch);
+
+// When nonzero, traces first get compiled quickly with few optimizations, and
+// then recompiled with all of them in the background after being called this
+// many times.  Defaults to DPRO_TIER_UP_THRESHOLD, or 0 (always optimize).
+void setJitTierUpThreshold(long threshold);
+
+// How traces get optimized: "full" (the default), "baseline", "vectorize"
+// (full, followed by the loop and SLP vectorizers), O1 to O3, or a list of
+// function passes in the syntax of opt -passes, eg
+// "instcombine,gvn,simplify-cfg".  Can also be set with DPRO_PIPELINE and
+// DPRO_BASELINE_PIPELINE.  Traces keep the pipelines that were set when they
+// were recorded, even if they get compiled or tiered up later.
+void setJitPipeline(const char* pipeline);
+void setJitBaselinePipeline(const char* pipeline);
+
+// Print how long each optimization pass took in total when the process
+// exits.  Can also be turned on with DPRO_TIME_PASSES=1.
+void setJitTimePasses(int enabled);
+
+// Record the globals and functions that traces use as constants of their
+// addresses in this process, rather than as symbols that get looked up when
+// the trace is linked.  Can also be turned on with DPRO_BIND_SYMBOLS=1.
+void setJitBindSymbols(int enabled);
+
+// Write /tmp/perf-<pid>.map, so that perf report can tell which trace samples
+// are in.  Traces are named after the function they start in.  Can also be
+// turned on with DPRO_PERF_MAP=1.
+void setJitPerfMap(int enabled);
+
+// Write a jitdump file (jit-<pid>.dump) into dir, which has each trace's code
+// and line numbers as well.  Record with perf record -k 1, and run
+// perf inject --jit on the result.  Can also be set with DPRO_JITDUMP_DIR.
+void setJitDumpDir(const char* dir);
+
+// Keep the source locations of recorded instructions in traces, with calls
+// that got traced into showing up as inlined, and register compiled traces
+// with gdb's JIT interface.  Line numbers show up in jitdump files too.  Only
+// affects traces recorded afterwards.  Can also be turned on with
+// DPRO_DEBUG_INFO=1.
+void setJitDebugInfo(int enabled);
+
+// Keep compiled traces in this directory, so that later runs that record the
+// same traces can skip compiling them.  Can also be set with
+// DPRO_OBJECT_CACHE.  Has to be set before anything gets compiled.
+void setJitObjectCache(const char* dir);
+
+typedef struct {
+    long pending;   // queued or being compiled
+    long completed; // traces and bridges
+    long cache_hits; // completed ones that came from the object cache
+    long code_bytes_reserved;
+    long code_bytes_used;
+    const char* cpu; // what traces are compiled for
+} JitCompileStats;
+JitCompileStats getJitCompileStats(void);
+
+// Blocks until every queued compile has been published.
+void waitForJitCompiles(void);
+
+// Frees all the code compiled for target (its trace, bridges off of it, and
+// code that got replaced by a higher tier), and starts counting its calls
+// again, unless it has been blacklisted.  None of that code may be running
+// on any thread.  Other traces that call target go through _runJitTarget
+// until it has been compiled again.
+void evictJitTarget(JitTarget* target);
+
+// The trace gets published from the compile thread when compiling
+// asynchronously.
+inline void* _jitTargetTrace(JitTarget* target) {
+    return __atomic_load_n(&target->jitted_trace, __ATOMIC_ACQUIRE);
+}
+
+// Whether a call can go straight to the native function.  The call that
+// makes a cold target hot is counted by _runJitTarget.
+inline int _jitTargetRunsNative(JitTarget* target) {
+    JitTargetState state = __atomic_load_n(&target->state, __ATOMIC_RELAXED);
+    if (state == JIT_TARGET_COLD
+        && target->call_count + 1 < target->hot_threshold) {
+        target->call_count++;
+        return 1;
+    }
+    return state == JIT_TARGET_BLACKLISTED;
+}
+
 inline long runJitTarget0(JitTarget* target) {
-    if (target->jitted_trace)
-        return ((long (*)())target->jitted_trace)();
+    void* trace = _jitTargetTrace(target);
+    if (trace)
+        return ((long (*)())trace)();
+    if (_jitTargetRunsNative(target))
+        return ((long (*)())target->target_function)();
     return _runJitTarget(target);
 }
 
 inline long runJitTarget1(JitTarget* target, long arg0) {
-    if (target->jitted_trace)
-        return ((long (*)(long))target->jitted_trace)(arg0);
+    void* trace = _jitTargetTrace(target);
+    if (trace)
+        return ((long (*)(long))trace)(arg0);
+    if (_jitTargetRunsNative(target))
+        return ((long (*)(long))target->target_function)(arg0);
     return _runJitTarget(target, arg0);
 }
 
 inline long runJitTarget2(JitTarget* target, long arg0, long arg1) {
-    if (target->jitted_trace)
-        return ((long (*)(long, long))target->jitted_trace)(arg0, arg1);
+    void* trace = _jitTargetTrace(target);
+    if (trace)
+        return ((long (*)(long, long))trace)(arg0, arg1);
+    if (_jitTargetRunsNative(target))
+        return ((long (*)(long, long))target->target_function)(arg0, arg1);
     return _runJitTarget(target, arg0, arg1);
 }
 
 inline long runJitTarget3(JitTarget* target, long arg0, long arg1, long arg2) {
-    if (target->jitted_trace)
-        return ((long (*)(long, long, long))target->jitted_trace)(arg0, arg1, arg2);
+    void* trace = _jitTargetTrace(target);
+    if (trace)
+        return ((long (*)(long, long, long))trace)(arg0, arg1, arg2);
+    if (_jitTargetRunsNative(target))
+        return ((long (*)(long, long, long))target->target_function)(arg0, arg1,
+                                                                     arg2);
     return _runJitTarget(target, arg0, arg1, arg2);
 }
 
@@ -1,89 +1,346 @@
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
+#include <link.h>
+#include <map>
 
 #include "llvm/ADT/iterator_range.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
-#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/Instructions.h"
-#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PassInstrumentation.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SHA1.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Scalar.h"
 
 using namespace llvm;
 using namespace llvm::orc;
 using namespace std;
 
+#include "codeheap.h"
 #include "common.h"
-
 #include "jit.h"
+#include "perf.h"
 
 namespace dcop {
 
+// Cached objects find their address table under this name
+static const char* const address_table_name = "__dpro_addresses";
+// What the trace in a cached object is called, since names aren't stable
+static const char* const cached_trace_name = "__dpro_trace";
+
+#ifdef __ELF__
+// Number of entries in a loaded object's dynamic symbol table, which the
+// dynamic section doesn't say directly.
+static int numDynamicSymbols(const ElfW(Word) * hash,
+                             const ElfW(Word) * gnu_hash) {
+    if (hash)
+        return hash[1]; // nchain
+    if (!gnu_hash)
+        return 0;
+
+    // Symbols below symoffset aren't in the hash table.  Above that, the
+    // last symbol is at the end of the chain of the highest bucket.
+    int nbuckets = gnu_hash[0];
+    int symoffset = gnu_hash[1];
+    int bloom_size = gnu_hash[2];
+    auto buckets = gnu_hash + 4 + bloom_size * sizeof(ElfW(Addr)) / 4;
+    auto chains = buckets + nbuckets;
+
+    int last = 0;
+    for (int i = 0; i < nbuckets; i++)
+        last = max(last, (int)buckets[i]);
+    if (last < symoffset)
+        return symoffset;
+    while (!(chains[last - symoffset] & 1))
+        last++;
+    return last + 1;
+}
+
+// dl_iterate_phdr callback that adds an object's dynamic symbols to a
+// StringMap.  Names that show up more than once (which dlsym resolves
+// according to load order and interposition) are set to 0.
+static int addDynamicSymbols(struct dl_phdr_info* info, size_t size,
+                             void* data) {
+    auto& symbols = *(StringMap<JITTargetAddress>*)data;
+
+    const ElfW(Dyn)* dynamic = nullptr;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        if (info->dlpi_phdr[i].p_type == PT_DYNAMIC)
+            dynamic = (const ElfW(Dyn)*)(info->dlpi_addr
+                                         + info->dlpi_phdr[i].p_vaddr);
+    }
+    if (!dynamic)
+        return 0;
+
+    const ElfW(Sym)* symtab = nullptr;
+    const char* strtab = nullptr;
+    const ElfW(Word)* hash = nullptr;
+    const ElfW(Word)* gnu_hash = nullptr;
+    const ElfW(Half)* versym = nullptr;
+    for (auto d = dynamic; d->d_tag != DT_NULL; d++) {
+        // These usually get relocated by the dynamic linker, but not always
+        // (eg in the vDSO)
+        auto ptr = d->d_un.d_ptr;
+        if (ptr < info->dlpi_addr)
+            ptr += info->dlpi_addr;
+
+        if (d->d_tag == DT_SYMTAB)
+            symtab = (const ElfW(Sym)*)ptr;
+        else if (d->d_tag == DT_STRTAB)
+            strtab = (const char*)ptr;
+        else if (d->d_tag == DT_HASH)
+            hash = (const ElfW(Word)*)ptr;
+        else if (d->d_tag == DT_GNU_HASH)
+            gnu_hash = (const ElfW(Word)*)ptr;
+        else if (d->d_tag == DT_VERSYM)
+            versym = (const ElfW(Half)*)ptr;
+    }
+    if (!symtab || !strtab)
+        return 0;
+
+    int num_symbols = numDynamicSymbols(hash, gnu_hash);
+    for (int i = 1; i < num_symbols; i++) {
+        auto& sym = symtab[i];
+        int type = ELF64_ST_TYPE(sym.st_info);
+        int bind = ELF64_ST_BIND(sym.st_info);
+        if (sym.st_shndx == SHN_UNDEF || !sym.st_name)
+            continue;
+        // IFUNCs resolve to something other than their address, and TLS
+        // symbols are offsets; dlsym knows what to do with those.
+        if (type != STT_FUNC && type != STT_OBJECT)
+            continue;
+        if (bind != STB_GLOBAL && bind != STB_WEAK)
+            continue;
+        // Old versions of a symbol, which dlsym doesn't return
+        if (versym && (versym[i] & 0x8000))
+            continue;
+
+        auto address = (JITTargetAddress)(info->dlpi_addr + sym.st_value);
+        auto r = symbols.insert(make_pair(strtab + sym.st_name, address));
+        if (!r.second && r.first->second != address)
+            r.first->second = 0;
+    }
+    return 0;
+}
+#endif
+
+// Traces only ever run on the machine that compiled them, so they get to use
+// everything it has rather than the baseline of its architecture.
+static vector<string> hostFeatures() {
+    vector<string> features;
+    StringMap<bool> host_features;
+    if (sys::getHostCPUFeatures(host_features)) {
+        for (auto& feature : host_features)
+            features.push_back((feature.second ? "+" : "-")
+                               + feature.first().str());
+    }
+    // The order StringMap iterates in isn't stable, and the feature string
+    // is part of the object cache key.
+    std::sort(features.begin(), features.end());
+    return features;
+}
+
+// Traces' code and data are all in the CodeHeap, within 2GB of each other, so
+// they can use the small code model instead of the large one the JIT defaults
+// to.  PIC keeps references to the rest of the process from assuming that it
+// is in the low 2GB of the address space.
+static TargetMachine* selectTarget() {
+    static const vector<string> features = hostFeatures();
+    return EngineBuilder()
+        .setCodeModel(CodeModel::Small)
+        .setRelocationModel(Reloc::PIC_)
+        .setMCPU(sys::getHostCPUName())
+        .setMAttrs(features)
+        .selectTarget();
+}
+
 // from llvm/examples/Kaleidoscope/include/KaleidoscopeJIT.h
 class LLVMJitCompiler {
 public:
   using ObjLayerT = RTDyldObjectLinkingLayer;
-  using CompileLayerT = IRCompileLayer<ObjLayerT, SimpleCompiler>;
 
   LLVMJitCompiler()
       : Resolver(createLegacyLookupResolver(
             ES,
-            [this](const std::string& Name) -> JITSymbol {
-                // Adapted from
-                // examples/Kaleidoscope/BuildingAJIT/Chapter4/KaleidoscopeJIT.h:
-                if (auto sym = ObjectLayer.findSymbol(Name, true))
-                    return sym;
-                if (auto SymAddr
-                    = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
-                    return JITSymbol(SymAddr, JITSymbolFlags::Exported);
-                return nullptr;
-            },
+            [this](const std::string& Name) { return findMangledSymbol(Name); },
             [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-        TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+        TM(selectTarget()), DL(TM->createDataLayout()),
         ObjectLayer(ES,
-                    [this](VModuleKey) {
+                    [this](VModuleKey K) {
                       return ObjLayerT::Resources{
-                          std::make_shared<SectionMemoryManager>(), Resolver};
-                    }),
-        CompileLayer(ObjectLayer, SimpleCompiler(*TM)) {
+                          std::make_shared<TraceMemoryManager>(),
+                          getResolver(K)};
+                    },
+                    [this](VModuleKey K, const object::ObjectFile &Obj,
+                           const RuntimeDyld::LoadedObjectInfo &Info) {
+                      notifyLoaded(K, Obj, Info);
+                    },
+                    [this](VModuleKey K, const object::ObjectFile &,
+                           const RuntimeDyld::LoadedObjectInfo &) {
+                      notifyFinalized(K);
+                    }) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+#ifdef __ELF__
+    dl_iterate_phdr(addDynamicSymbols, &ProcessSymbols);
+#endif
   }
 
   TargetMachine &getTargetMachine() { return *TM; }
+  PerfOutput &getPerfOutput() { return Perf; }
+
+  // Objects loaded from then on show up in gdb
+  void registerWithGDB() {
+    GDBListener = JITEventListener::createGDBRegistrationListener();
+  }
 
-  VModuleKey addModule(std::unique_ptr<Module> M) {
+  // Addresses is what the object's address table (see AddressRelocator)
+  // should hold in this process.  TraceName is what a trace from the cache
+  // gets called in profiles.
+  VModuleKey addObject(std::unique_ptr<MemoryBuffer> Obj,
+                       std::vector<uint64_t> Addresses = {},
+                       std::string TraceName = "") {
     auto K = ES.allocateVModule();
-    cantFail(CompileLayer.addModule(K, std::move(M)));
-    ModuleKeys.push_back(K);
+    if (!Addresses.empty())
+      AddressTables[K] = std::move(Addresses);
+    if (!TraceName.empty())
+      TraceNames[K] = std::move(TraceName);
+
+    auto ObjFile =
+        cantFail(object::ObjectFile::createObjectFile(Obj->getMemBufferRef()));
+    for (auto &Sym : ObjFile->symbols()) {
+      auto Flags = Sym.getFlags();
+      if ((Flags & object::SymbolRef::SF_Undefined) ||
+          !(Flags & object::SymbolRef::SF_Exported))
+        continue;
+      addDefinition(K, cantFail(Sym.getName()));
+    }
+
+    cantFail(ObjectLayer.addObject(K, std::move(Obj)));
     return K;
   }
 
   void removeModule(VModuleKey K) {
-    ModuleKeys.erase(find(ModuleKeys, K));
-    cantFail(CompileLayer.removeModule(K));
+    for (auto &Name : KeySymbols[K]) {
+      auto &Keys = JITSymbols[Name];
+      Keys.erase(find(Keys, K));
+    }
+    KeySymbols.erase(K);
+    AddressTables.erase(K);
+    TraceNames.erase(K);
+    if (GDBListener)
+      GDBListener->notifyFreeingObject(K);
+    // While the code is still there, since jitdump records include it
+    auto it = Reported.find(K);
+    if (it != Reported.end()) {
+      for (auto &Code : it->second)
+        Perf.removeCode(Code);
+      Reported.erase(it);
+    }
+    cantFail(ObjectLayer.removeObject(K));
   }
 
   JITSymbol findSymbol(const std::string Name) {
     return findMangledSymbol(mangle(Name));
   }
 
+  JITSymbol findSymbolIn(VModuleKey K, const std::string Name) {
+    return ObjectLayer.findSymbolIn(K, mangle(Name), true);
+  }
+
 private:
+  // Objects are loaded and then finalized in one go, so whatever is going to
+  // be reported to perf waits in Loaded until the code is done.
+  void notifyLoaded(VModuleKey K, const object::ObjectFile &Obj,
+                    const RuntimeDyld::LoadedObjectInfo &Info) {
+    if (GDBListener)
+      GDBListener->notifyObjectLoaded(K, Obj, Info);
+
+    if (!Perf.isOpen())
+      return;
+    Loaded = Perf.readObject(Obj, Info);
+    if (TraceNames.count(K))
+      for (auto &Code : Loaded)
+        if (Code.name == cached_trace_name)
+          Code.name = TraceNames[K];
+  }
+
+  void notifyFinalized(VModuleKey K) {
+    for (auto &Code : Loaded)
+      Perf.addCode(Code);
+    if (!Loaded.empty())
+      Reported[K] = std::move(Loaded);
+    Loaded.clear();
+  }
+
+  void addDefinition(VModuleKey K, StringRef Name) {
+    JITSymbols[Name].push_back(K);
+    KeySymbols[K].push_back(Name.str());
+  }
+
+  JITTargetAddress findProcessSymbol(const std::string &Name) {
+    auto it = ProcessSymbols.find(Name);
+    if (it != ProcessSymbols.end() && it->second)
+      return it->second;
+
+    // Not in the dynamic symbol tables we read up front, or ambiguous there.
+    // Misses aren't remembered, since the symbol could still get loaded.
+    auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name);
+    if (SymAddr)
+      ProcessSymbols[Name] = SymAddr;
+    return SymAddr;
+  }
+
+  std::shared_ptr<SymbolResolver> getResolver(VModuleKey K) {
+    auto it = AddressTables.find(K);
+    if (it == AddressTables.end())
+      return Resolver;
+
+    // The table is never modified after this, and only goes away along with
+    // the object's code (see removeModule).
+    auto TableName = mangle(address_table_name);
+    auto TableAddr = (JITTargetAddress)it->second.data();
+    return createLegacyLookupResolver(
+        ES,
+        [this, TableName, TableAddr](const std::string &Name) -> JITSymbol {
+          if (Name == TableName)
+            return JITSymbol(TableAddr, JITSymbolFlags::Exported);
+          return findMangledSymbol(Name);
+        },
+        [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); });
+  }
+
   std::string mangle(const std::string &Name) {
     std::string MangledName;
     {
@@ -97,7 +354,7 @@ private:
 #ifdef _WIN32
     // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
     // flag to decide whether a symbol will be visible or not, when we call
-    // IRCompileLayer::findSymbolIn with ExportedSymbolsOnly set to true.
+    // findSymbolIn with ExportedSymbolsOnly set to true.
     //
     // But for Windows COFF objects, this flag is currently never set.
     // For a potential solution see: https://reviews.llvm.org/rL258665
@@ -107,15 +364,16 @@ private:
     const bool ExportedSymbolsOnly = true;
 #endif
 
-    // Search modules in reverse order: from last added to first added.
-    // This is the opposite of the usual search order for dlsym, but makes more
-    // sense in a REPL where we want to bind to the newest available definition.
-    for (auto H : make_range(ModuleKeys.rbegin(), ModuleKeys.rend()))
-      if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
+    // Bind to the newest definition.  This is the opposite of the usual
+    // search order for dlsym, but makes more sense in a REPL.
+    auto it = JITSymbols.find(Name);
+    if (it != JITSymbols.end() && !it->second.empty())
+      if (auto Sym = ObjectLayer.findSymbolIn(it->second.back(), Name,
+                                              ExportedSymbolsOnly))
         return Sym;
 
     // If we can't find the symbol in the JIT, try looking in the host process.
-    if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
+    if (auto SymAddr = findProcessSymbol(Name))
       return JITSymbol(SymAddr, JITSymbolFlags::Exported);
 
 #ifdef _WIN32
@@ -136,29 +394,605 @@ private:
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
   ObjLayerT ObjectLayer;
-  CompileLayerT CompileLayer;
-  std::vector<VModuleKey> ModuleKeys;
+  std::map<VModuleKey, std::vector<uint64_t>> AddressTables;
+
+  // Which modules define each symbol, oldest first
+  StringMap<std::vector<VModuleKey>> JITSymbols;
+  std::map<VModuleKey, std::vector<std::string>> KeySymbols;
+  // Seeded from the dynamic symbol tables of everything that was loaded when
+  // we started, and then with whatever dlsym finds.  0 for names we have to
+  // ask dlsym about.
+  StringMap<JITTargetAddress> ProcessSymbols;
+
+  PerfOutput Perf;
+  std::map<VModuleKey, std::string> TraceNames;
+  std::vector<PerfOutput::Code> Loaded;
+  // What perf has been told about each object, to take back when it goes
+  std::map<VModuleKey, std::vector<PerfOutput::Code>> Reported;
+  JITEventListener *GDBListener = nullptr;
+};
+
+
+namespace {
+
+// Traces have the addresses of runtime objects (side exits, and any pointers
+// they were specialized on) baked in as inttoptr constants, so an object
+// compiled in one process would be wrong in any other.  Before caching a
+// trace, these get replaced with loads from a table that the object is
+// linked against; each process fills the table in with its own addresses.
+//
+// Loading the addresses keeps them out of the optimizer's hands, which costs
+// a little, but turning them into symbols instead would let alias analysis
+// assume that different addresses point into different objects.
+class AddressRelocator {
+private:
+    Function* func;
+    Instruction* insert_before;
+    GlobalVariable* table;
+    vector<uint64_t> addresses;
+    unordered_map<uint64_t, int> indices; // into addresses
+    unordered_map<Constant*, llvm::Value*> materialized;
+
+    llvm::Value* loadAddress(uint64_t address, Type* type) {
+        auto it = indices.find(address);
+        if (it == indices.end()) {
+            it = indices.emplace(address, addresses.size()).first;
+            addresses.push_back(address);
+        }
+
+        auto i64 = Type::getInt64Ty(func->getContext());
+        auto ptr = GetElementPtrInst::CreateInBounds(
+            table, { ConstantInt::get(i64, it->second) }, "", insert_before);
+        auto load = new LoadInst(ptr, "", insert_before);
+        load->setMetadata(LLVMContext::MD_invariant_load,
+                          MDNode::get(func->getContext(), {}));
+        return new IntToPtrInst(load, type, "", insert_before);
+    }
+
+    // Returns c itself if there's nothing to relocate in it
+    llvm::Value* materialize(Constant* c) {
+        auto ce = dyn_cast<ConstantExpr>(c);
+        if (!ce)
+            return c;
+
+        auto it = materialized.find(c);
+        if (it != materialized.end())
+            return it->second;
+
+        llvm::Value* r = c;
+        if (ce->getOpcode() == Instruction::IntToPtr
+            && isa<ConstantInt>(ce->getOperand(0))) {
+            auto address = cast<ConstantInt>(ce->getOperand(0));
+            r = loadAddress(address->getZExtValue(), ce->getType());
+        } else {
+            vector<llvm::Value*> operands;
+            bool changed = false;
+            for (auto& op : ce->operands()) {
+                operands.push_back(materialize(cast<Constant>(op)));
+                changed |= operands.back() != op;
+            }
+            if (changed) {
+                auto inst = ce->getAsInstruction();
+                for (int i = 0; i < operands.size(); i++)
+                    inst->setOperand(i, operands[i]);
+                inst->insertBefore(insert_before);
+                r = inst;
+            }
+        }
+        materialized[c] = r;
+        return r;
+    }
+
+public:
+    AddressRelocator(Function* func) : func(func) {}
+
+    vector<uint64_t> run() {
+        auto& entry = func->getEntryBlock();
+        insert_before = &*entry.getFirstInsertionPt();
+        table = new GlobalVariable(*func->getParent(),
+                                   Type::getInt64Ty(func->getContext()),
+                                   /* constant */ true,
+                                   GlobalValue::ExternalLinkage, nullptr,
+                                   address_table_name);
+
+        // The entry block gets added to as we go
+        vector<Instruction*> insts;
+        for (auto& bb : *func) {
+            for (auto& inst : bb)
+                insts.push_back(&inst);
+        }
+
+        for (auto inst : insts) {
+            for (auto& op : inst->operands()) {
+                // Things like the callee of a call are already constants
+                // without any addresses in them
+                if (!isa<ConstantExpr>(op))
+                    continue;
+                auto v = materialize(cast<Constant>(op));
+                if (v != op)
+                    op.set(v);
+            }
+        }
+
+        if (addresses.empty())
+            table->eraseFromParent();
+        return addresses;
+    }
 };
+}
+
+// Objects in the cache are named after everything that goes into them.  Only
+// the names of named pipelines are part of the key, so the version has to be
+// bumped when one of them changes.
+static string objectCacheKey(const Module& module, const TargetMachine& tm,
+                             LLVMCompiler::Tier tier, const string& pipeline) {
+    string bitcode;
+    raw_string_ostream os(bitcode);
+    WriteBitcodeToFile(module, os);
+    os.flush();
+
+    SHA1 hasher;
+    hasher.update("dpro-object-cache-v1");
+    hasher.update(tier == LLVMCompiler::Baseline ? "baseline" : "optimized");
+    hasher.update(pipeline + '\n');
+    hasher.update(tm.getTargetTriple().str());
+    hasher.update(tm.getTargetCPU());
+    hasher.update(tm.getTargetFeatureString());
+    hasher.update(to_string(tm.getCodeModel()) + ' '
+                  + to_string(tm.getRelocationModel()));
+    hasher.update(bitcode);
+    return toHex(hasher.final(), /* lowercase */ true);
+}
 
+// Several processes can share a cache directory, so objects show up in it
+// atomically.
+static void writeCachedObject(const string& path, const MemoryBuffer& object) {
+    int fd;
+    SmallString<128> tmp_path;
+    if (sys::fs::createUniqueFile(path + "-%%%%%%.tmp", fd, tmp_path))
+        return;
+    {
+        raw_fd_ostream os(fd, /* shouldClose */ true);
+        os << object.getBuffer();
+    }
+    if (sys::fs::rename(tmp_path, path))
+        sys::fs::remove(tmp_path);
+}
 
-LLVMCompiler::LLVMCompiler() {
+LLVMCompiler::LLVMCompiler()
+    : async(false),
+      num_threads(max(1, (int)thread::hardware_concurrency() - 1)),
+      max_queued(64),
+      max_batch(16),
+      shutting_down(false),
+      num_pending(0),
+      num_completed(0),
+      num_cache_hits(0),
+      tier_up_threshold(0),
+      pipelines{ "baseline", "full" },
+      time_passes(false),
+      bind_symbols(false),
+      debug_info(false) {
     InitializeNativeTarget();
     InitializeNativeTargetAsmPrinter();
     jit = std::make_unique<LLVMJitCompiler>();
+    target_cpu = jit->getTargetMachine().getTargetCPU().str();
 }
 
 LLVMCompiler::~LLVMCompiler() {
+    {
+        lock_guard<mutex> guard(queue_lock);
+        shutting_down = true;
+    }
+    queue_cv.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+
+    if (time_passes)
+        printPassTimes();
+}
+
+// Baseline code counts its calls, and the call that reaches the threshold
+// asks for the optimized version.  Only entries are counted, so a trace that
+// spends all its time in one long loop stays at the baseline tier.
+static void addTierUpCounter(Function* func, long* counter, long threshold,
+                             void (*tier_up)(void*), void* arg) {
+    auto& context = func->getContext();
+    auto i64 = Type::getInt64Ty(context);
+    auto i8_ptr = Type::getInt8PtrTy(context);
+
+    // Allocas stay in the entry block so that they're still static
+    auto& entry = func->getEntryBlock();
+    auto it = entry.begin();
+    while (isa<AllocaInst>(*it))
+        ++it;
+    auto rest = entry.splitBasicBlock(it);
+    entry.getTerminator()->eraseFromParent();
+
+    auto counter_ptr = ConstantExpr::getIntToPtr(
+        ConstantInt::get(i64, (intptr_t)counter), i64->getPointerTo());
+    auto old_count = new AtomicRMWInst(
+        AtomicRMWInst::Add, counter_ptr, ConstantInt::get(i64, 1),
+        AtomicOrdering::Monotonic, SyncScope::System, &entry);
+    auto cond = new ICmpInst(entry, CmpInst::ICMP_EQ, old_count,
+                             ConstantInt::get(i64, threshold - 1));
+
+    auto tier_up_bb = BasicBlock::Create(context, "tier_up", func, rest);
+    auto branch = BranchInst::Create(tier_up_bb, rest, cond, &entry);
+    branch->setMetadata(LLVMContext::MD_prof,
+                        MDBuilder(context).createBranchWeights(1, 2000));
+
+    auto tier_up_type
+        = FunctionType::get(Type::getVoidTy(context), { i8_ptr }, false);
+    auto tier_up_ptr = ConstantExpr::getIntToPtr(
+        ConstantInt::get(i64, (intptr_t)tier_up),
+        tier_up_type->getPointerTo());
+    auto arg_ptr
+        = ConstantExpr::getIntToPtr(ConstantInt::get(i64, (intptr_t)arg), i8_ptr);
+    CallInst::Create(tier_up_ptr, { arg_ptr }, "", tier_up_bb);
+    BranchInst::Create(rest, tier_up_bb);
 }
 
-void* LLVMCompiler::compile(unique_ptr<Module> module, string funcname) {
-    jit->addModule(move(module));
+// Generating the object is the expensive part, and can happen on any number
+// of threads at once; only linking it in is serialized.
+static unique_ptr<MemoryBuffer> emitObject(Module& module, TargetMachine& tm,
+                                           LLVMCompiler::Tier tier) {
+    // FastISel for the baseline tier.  This sticks once it's been turned on,
+    // so it gets set explicitly either way.
+    tm.setOptLevel(tier == LLVMCompiler::Baseline ? CodeGenOpt::None
+                                                  : CodeGenOpt::Default);
+    tm.setFastISel(tier == LLVMCompiler::Baseline);
+
+    auto object = SimpleCompiler(tm)(module);
+    RELEASE_ASSERT(object, "codegen failed");
+    return object;
+}
+
+void* LLVMCompiler::codegen(unique_ptr<Module> module, const CompileJob& job,
+                            TargetMachine& tm, bool verbose) {
+    Function* func = module->getFunction(job.funcname);
+    RELEASE_ASSERT(func, "%s", job.funcname.c_str());
+
+    auto tier_up = job.tier_up;
+    Tier tier = tier_up ? Baseline : Optimized;
+    if (tier_up)
+        addTierUpCounter(func, &tier_up->count, tier_up_threshold,
+                         &LLVMCompiler::tierUp, tier_up);
+
+    unique_ptr<MemoryBuffer> object;
+    vector<uint64_t> addresses;
+    string cache_path;
+    if (!cache_dir.empty()) {
+        addresses = AddressRelocator(func).run();
+        // Names depend on the order things got recorded in, so they can't
+        // be part of the key.  Symbols get looked up per object anyway.
+        func->setName(cached_trace_name);
+        module->setModuleIdentifier("trace");
+        module->setSourceFileName("trace");
+
+        cache_path = cache_dir + "/"
+                     + objectCacheKey(*module, tm, tier, job.pipeline)
+                     + ".o";
+        if (auto cached = MemoryBuffer::getFile(cache_path))
+            object = move(*cached);
+    }
+
+    bool cache_hit = (bool)object;
+    if (!object) {
+        optimizeFunction(func, tm, job.pipeline);
+        // The marker tells this apart from the dump that finish() printed
+        if (verbose)
+            outs() << "Optimized " << job.funcname << ":\n"
+                   << *module << '\n';
 
-    auto r = jit->findSymbol(funcname);
+        RELEASE_ASSERT(!verifyFunction(*func, &errs()),
+                       "function failed to verify");
+
+        object = emitObject(*module, tm, tier);
+        if (!cache_path.empty())
+            writeCachedObject(cache_path, *object);
+    }
+
+    lock_guard<mutex> guard(jit_lock);
+    if (cache_hit)
+        num_cache_hits++;
+    if (!CodeHeap::get().hasRoomFor(object->getBufferSize())) {
+        errs() << "The code heap is full, not loading " << job.funcname
+               << '\n';
+        return nullptr;
+    }
+    auto key = jit->addObject(move(object), move(addresses), job.funcname);
+    addOwner(job.owner, key);
+
+    auto r = jit->findSymbolIn(key, func->getName().str());
     RELEASE_ASSERT(r, "uh oh");
     ExitOnError ExitOnErr;
     return (void*)ExitOnErr(r.getAddress());
 }
 
+void LLVMCompiler::compile(unique_ptr<Module> module, string funcname,
+                           Callback done, const long* hotness,
+                           const void* owner) {
+    CompileJob job;
+    job.funcname = move(funcname);
+    job.done = move(done);
+    job.hotness = hotness;
+    job.tier_up = nullptr;
+    job.owner = owner;
+    job.pipeline = pipelines[Optimized];
+
+    // The module belongs to the interpreter's LLVMContext, which the compile
+    // threads can't touch, so it gets handed over as bitcode.  The optimized
+    // tier gets compiled from the same bitcode later on.
+    if (async || tier_up_threshold > 0) {
+        raw_string_ostream os(job.bitcode);
+        WriteBitcodeToFile(*module, os);
+        os.flush();
+    }
+
+    if (tier_up_threshold > 0) {
+        tier_ups.emplace_back(new TierUp{ this, job, 0 });
+        job.tier_up = tier_ups.back().get();
+        job.pipeline = pipelines[Baseline];
+    }
+
+    if (!async) {
+        job.done(codegen(move(module), job, jit->getTargetMachine(), true));
+        lock_guard<mutex> guard(queue_lock);
+        num_completed++;
+        return;
+    }
+
+    enqueue(move(job));
+}
+
+void LLVMCompiler::enqueue(CompileJob job) {
+    {
+        unique_lock<mutex> guard(queue_lock);
+        while ((int)workers.size() < num_threads)
+            workers.emplace_back(&LLVMCompiler::workerLoop, this);
+
+        // Backpressure: don't let recording get arbitrarily far ahead
+        queue_cv.wait(guard,
+                      [this] { return (int)queue.size() < max_queued; });
+        queue.push_back(move(job));
+        num_pending++;
+    }
+    queue_cv.notify_all();
+}
+
+void LLVMCompiler::tierUp(void* arg) {
+    // Always in the background, even when baseline code is compiled
+    // synchronously; the baseline code keeps running until it's done.
+    auto tier_up = (TierUp*)arg;
+    tier_up->compiler->enqueue(tier_up->job);
+}
+
+static long hotnessOf(const long* hotness) {
+    // Written by the interpreter thread without any locking; a stale value
+    // only affects the order things get compiled in.
+    return hotness ? __atomic_load_n(hotness, __ATOMIC_RELAXED) : 0;
+}
+
+void LLVMCompiler::codegenBatch(vector<CompileJob>& jobs, LLVMContext& context,
+                                TargetMachine& tm) {
+    // Traces are optimized one at a time, as usual, and then linked into one
+    // module so that they share a codegen run and a memory manager.
+    Tier tier = jobs[0].tier_up ? Baseline : Optimized;
+    unique_ptr<Module> batch;
+    for (auto& job : jobs) {
+        auto module = cantFail(parseBitcodeFile(
+            MemoryBufferRef(job.bitcode, job.funcname), context));
+        Function* func = module->getFunction(job.funcname);
+        RELEASE_ASSERT(func, "%s", job.funcname.c_str());
+
+        if (job.tier_up)
+            addTierUpCounter(func, &job.tier_up->count, tier_up_threshold,
+                             &LLVMCompiler::tierUp, job.tier_up);
+        optimizeFunction(func, tm, job.pipeline);
+        RELEASE_ASSERT(!verifyFunction(*func, &errs()),
+                       "function failed to verify");
+
+        if (!batch) {
+            batch = move(module);
+        } else if (Linker::linkModules(*batch, move(module))) {
+            // The batch may be half linked by now, so it gets dropped, and
+            // every trace in it compiled on its own, as if there had been
+            // no batching.
+            errs() << "couldn't link " << job.funcname
+                   << " into a batch; compiling its traces separately\n";
+            batch.reset();
+            for (auto& single : jobs) {
+                auto single_module = cantFail(parseBitcodeFile(
+                    MemoryBufferRef(single.bitcode, single.funcname),
+                    context));
+                single.done(codegen(move(single_module), single, tm, false));
+            }
+            return;
+        }
+    }
+
+    auto object = emitObject(*batch, tm, tier);
+
+    vector<void*> addresses;
+    {
+        lock_guard<mutex> guard(jit_lock);
+        if (!CodeHeap::get().hasRoomFor(object->getBufferSize())) {
+            errs() << "The code heap is full, not loading a batch of "
+                   << jobs.size() << " traces\n";
+            for (auto& job : jobs)
+                job.done(nullptr);
+            return;
+        }
+        auto key = jit->addObject(move(object));
+        ExitOnError ExitOnErr;
+        for (auto& job : jobs) {
+            addOwner(job.owner, key);
+            // Each trace is still looked up on its own
+            auto r = jit->findSymbolIn(key, job.funcname);
+            RELEASE_ASSERT(r, "%s", job.funcname.c_str());
+            addresses.push_back((void*)ExitOnErr(r.getAddress()));
+        }
+    }
+
+    for (int i = 0; i < jobs.size(); i++)
+        jobs[i].done(addresses[i]);
+}
+
+void LLVMCompiler::workerLoop() {
+    // Modules are gone once they've been turned into objects, so one context
+    // can be reused for everything this thread compiles.
+    LLVMContext worker_context;
+    unique_ptr<TargetMachine> tm(selectTarget());
+    // Errors get reported to the context, which by default exits.  A batch
+    // that fails to link gets compiled another way instead.
+    worker_context.setDiagnosticHandlerCallBack(
+        [](const DiagnosticInfo& info, void*) {
+            DiagnosticPrinterRawOStream printer(errs());
+            info.print(printer);
+            errs() << '\n';
+        },
+        nullptr);
+
+    while (true) {
+        vector<CompileJob> jobs;
+        {
+            unique_lock<mutex> guard(queue_lock);
+            queue_cv.wait(guard,
+                          [this] { return shutting_down || !queue.empty(); });
+            if (shutting_down)
+                return;
+
+            // Traces that are waiting at the same time get compiled together,
+            // up to max_batch of them, but leaving enough for the other
+            // threads to do.  Cached objects are per trace, so there's no
+            // batching when there's a cache.
+            int batch_size = 1;
+            if (cache_dir.empty()) {
+                int share = (queue.size() + num_threads - 1) / num_threads;
+                batch_size = min(max_batch, share);
+            }
+
+            Tier tier = Optimized;
+            while ((int)jobs.size() < batch_size) {
+                // Hottest first
+                auto next = queue.end();
+                for (auto it = queue.begin(); it != queue.end(); ++it) {
+                    // Each codegen run is for one tier
+                    Tier it_tier = it->tier_up ? Baseline : Optimized;
+                    if (!jobs.empty() && it_tier != tier)
+                        continue;
+                    if (next == queue.end()
+                        || hotnessOf(it->hotness) > hotnessOf(next->hotness))
+                        next = it;
+                }
+                if (next == queue.end())
+                    break;
+
+                tier = next->tier_up ? Baseline : Optimized;
+                jobs.push_back(move(*next));
+                queue.erase(next);
+            }
+        }
+        // There's room in the queue now
+        queue_cv.notify_all();
+
+        if (jobs.size() == 1) {
+            auto& job = jobs[0];
+            auto module = cantFail(parseBitcodeFile(
+                MemoryBufferRef(job.bitcode, job.funcname), worker_context));
+            // Printing from here would interleave with the interpreter's
+            // output
+            job.done(codegen(move(module), job, *tm, false));
+        } else {
+            codegenBatch(jobs, worker_context, *tm);
+        }
+
+        {
+            lock_guard<mutex> guard(queue_lock);
+            num_pending -= jobs.size();
+            num_completed += jobs.size();
+        }
+        queue_cv.notify_all();
+    }
+}
+
+void LLVMCompiler::setDebugInfo(bool debug_info) {
+    this->debug_info = debug_info;
+    if (debug_info) {
+        lock_guard<mutex> guard(jit_lock);
+        jit->registerWithGDB();
+    }
+}
+
+void LLVMCompiler::setPerfMap(bool enabled) {
+    if (enabled)
+        jit->getPerfOutput().openPerfMap();
+}
+
+void LLVMCompiler::setJitDumpDir(const string& dir) {
+    jit->getPerfOutput().openJitDump(dir);
+}
+
+void LLVMCompiler::waitForCompiles() {
+    unique_lock<mutex> guard(queue_lock);
+    queue_cv.wait(guard, [this] { return num_pending == 0; });
+}
+
+long LLVMCompiler::numPending() {
+    lock_guard<mutex> guard(queue_lock);
+    return num_pending;
+}
+
+long LLVMCompiler::numCompleted() {
+    lock_guard<mutex> guard(queue_lock);
+    return num_completed;
+}
+
+void LLVMCompiler::setCacheDir(const string& dir) {
+    RELEASE_ASSERT(!sys::fs::create_directories(dir), "%s", dir.c_str());
+    cache_dir = dir;
+}
+
+void LLVMCompiler::addOwner(const void* owner, uint64_t key) {
+    if (!owner)
+        return;
+    owned_objects[owner].push_back(key);
+    object_owners[key]++;
+}
+
+void LLVMCompiler::evict(const void* owner) {
+    // Otherwise a compile could publish code for the owner after this
+    waitForCompiles();
+
+    // Each of these holds a copy of a trace's bitcode.  Only the interpreter
+    // thread adds to them, and nothing runs the baseline code that points at
+    // them any more.
+    tier_ups.erase(std::remove_if(tier_ups.begin(), tier_ups.end(),
+                                  [owner](const unique_ptr<TierUp>& t) {
+                                      return t->job.owner == owner;
+                                  }),
+                   tier_ups.end());
+
+    lock_guard<mutex> guard(jit_lock);
+    auto it = owned_objects.find(owner);
+    if (it == owned_objects.end())
+        return;
+    // Batched objects are shared, and stay until all of their owners go
+    for (auto key : it->second) {
+        if (--object_owners[key] == 0) {
+            object_owners.erase(key);
+            jit->removeModule(key);
+        }
+    }
+    owned_objects.erase(it);
+}
+
+long LLVMCompiler::numCacheHits() {
+    lock_guard<mutex> guard(jit_lock);
+    return num_cache_hits;
+}
+
 // From Pyston:
 std::string LLVMJit::getUniqueFunctionName(string nameprefix) {
     static llvm::StringMap<int> used_module_names;
@@ -178,7 +1012,13 @@ LLVMJit::LLVMJit(const Function* orig_function, LLVMContext* llvm_context,
                  LLVMCompiler* compiler)
     : llvm_context(llvm_context),
       compiler(compiler),
-      module(new llvm::Module("module", *llvm_context)) {
+      module(new llvm::Module("module", *llvm_context)),
+      is_bridge(false),
+      exit_buffer(nullptr),
+      num_exit_slots(0),
+      may_have_side_effects(false),
+      recording(true),
+      num_instructions(0) {
     startScope();
 
     module->setDataLayout(orig_function->getParent()->getDataLayout());
@@ -186,8 +1026,14 @@ LLVMJit::LLVMJit(const Function* orig_function, LLVMContext* llvm_context,
     //FunctionType* ft = FunctionType::get(ret_type, arg_types, false /*vararg*/);
     FunctionType* ft = orig_function->getFunctionType();
 
-    func = Function::Create(ft, Function::ExternalLinkage,
-                            getUniqueFunctionName("traced"), module.get());
+    // Profiles show traces under these names
+    func = Function::Create(
+        ft, Function::ExternalLinkage,
+        getUniqueFunctionName("traced_" + orig_function->getName().str()),
+        module.get());
+    if (compiler->emitsDebugInfo())
+        startDebugInfo(orig_function,
+                       "traced_" + orig_function->getName().str());
 
     cur_bb = BasicBlock::Create(*llvm_context, "", func);
 
@@ -201,12 +1047,91 @@ LLVMJit::LLVMJit(const Function* orig_function, LLVMContext* llvm_context,
     }
 }
 
-void LLVMJit::startScope() {
+LLVMJit::LLVMJit(const SideExit* exit, LLVMContext* llvm_context,
+                 LLVMCompiler* compiler)
+    : llvm_context(llvm_context),
+      compiler(compiler),
+      module(new llvm::Module("module", *llvm_context)),
+      is_bridge(true),
+      exit_buffer(nullptr),
+      num_exit_slots(0),
+      may_have_side_effects(!exit->restartable),
+      recording(true),
+      num_instructions(0) {
+    startScope();
+
+    auto root_function = exit->frames.back().function;
+    module->setDataLayout(root_function->getParent()->getDataLayout());
+
+    auto i64 = Type::getInt64Ty(*llvm_context);
+    FunctionType* ft = FunctionType::get(
+        i64, { Type::getInt8PtrTy(*llvm_context), i64->getPointerTo() },
+        false /*vararg*/);
+
+    func = Function::Create(
+        ft, Function::ExternalLinkage,
+        getUniqueFunctionName("bridge_" + root_function->getName().str()),
+        module.get());
+    if (compiler->emitsDebugInfo())
+        startDebugInfo(root_function,
+                       "bridge_" + root_function->getName().str());
+
+    cur_bb = BasicBlock::Create(*llvm_context, "", func);
+}
+
+// The subprogram is named without the counter that function names get, since
+// it ends up in cached objects.
+void LLVMJit::startDebugInfo(const Function* orig_function,
+                             const string& name) {
+    di_builder.reset(new DIBuilder(*module));
+    module->addModuleFlag(Module::Warning, "Debug Info Version",
+                          DEBUG_METADATA_VERSION);
+    module->addModuleFlag(Module::Warning, "Dwarf Version", 4);
+
+    auto orig_sp = orig_function->getSubprogram();
+    auto file = orig_sp ? orig_sp->getFile()
+                        : di_builder->createFile("<trace>", "");
+    unsigned line = orig_sp ? orig_sp->getLine() : 0;
+    di_builder->createCompileUnit(dwarf::DW_LANG_C, file, "dpro",
+                                  /* optimized */ true, "", 0);
+    auto sp = di_builder->createFunction(
+        file, name, StringRef(), file, line,
+        di_builder->createSubroutineType(
+            di_builder->getOrCreateTypeArray({})),
+        line, DINode::FlagArtificial,
+        DISubprogram::SPFlagDefinition | DISubprogram::SPFlagOptimized);
+    func->setSubprogram(sp);
+
+    // The outermost scope was started before there was a subprogram
+    inlined_at.push_back(DILocation::get(*llvm_context, line, 0, sp));
+}
+
+// Traced calls look like they got inlined at call_site
+DILocation* LLVMJit::inlinedAt(const Instruction* call_site) {
+    if (!call_site || !call_site->getDebugLoc())
+        return inlined_at.back();
+    DILocation* call = DebugLoc::appendInlinedAt(
+        call_site->getDebugLoc(), inlined_at.back(), *llvm_context,
+        inlined_at_cache);
+    // Distinct, like the inliner makes it, so that separate calls from the
+    // same place don't get merged
+    return DILocation::getDistinct(*llvm_context, call->getLine(),
+                                   call->getColumn(), call->getScope(),
+                                   call->getInlinedAt());
+}
+
+void LLVMJit::startScope(const Instruction* call_site) {
     vmaps.emplace_back();
+    alias_scopes.emplace_back();
+    if (di_builder)
+        inlined_at.push_back(inlinedAt(call_site));
 }
 
 void LLVMJit::endScope() {
     vmaps.pop_back();
+    alias_scopes.pop_back();
+    if (di_builder)
+        inlined_at.pop_back();
 }
 
 Value* LLVMJit::arg(int argnum) {
@@ -218,24 +1143,41 @@ Value* LLVMJit::arg(int argnum) {
     return &*AI;
 }
 
+Value* LLVMJit::liveValue(int index, Type* type) {
+    RELEASE_ASSERT(is_bridge, "only bridges receive live values");
+    auto ptr = GetElementPtrInst::CreateInBounds(
+        arg(1), { ConstantInt::get(Type::getInt64Ty(*llvm_context), index) },
+        "", cur_bb);
+    return fromLong(new LoadInst(ptr, "", cur_bb), type, cur_bb);
+}
+
 Value* LLVMJit::constantInt(long value, Type* type) {
+    if (type->isPointerTy())
+        return ConstantExpr::getIntToPtr(
+            ConstantInt::get(Type::getInt64Ty(*llvm_context), value), type);
     return ConstantInt::get(type, value,
                             /* signed */ true);
 }
 
 Value* LLVMJit::alloca(Type* type) {
+    if (!recording)
+        return nullptr;
     auto r = new AllocaInst(type, 0);
     func->front().getInstList().insert(func->front().getFirstInsertionPt(), r);
     return r;
 }
 
 Value* LLVMJit::bitcast(Value v, llvm::Type* type) {
+    if (!recording)
+        return nullptr;
     auto r = new BitCastInst(v, type);
     cur_bb->getInstList().push_back(r);
     return r;
 }
 
 Value* LLVMJit::gepInBounds(Value v, vector<int> indices) {
+    if (!recording)
+        return nullptr;
     vector<llvm::Value*> llvm_indices;
     for (auto i : indices) {
         llvm_indices.push_back(
@@ -247,48 +1189,92 @@ Value* LLVMJit::gepInBounds(Value v, vector<int> indices) {
 }
 
 void LLVMJit::store(Value v, Value ptr) {
+    if (!recording)
+        return;
     auto r = new StoreInst(v, ptr);
     cur_bb->getInstList().push_back(r);
+    may_have_side_effects = true;
 }
 
 Constant* LLVMJit::cloneConstant(const Constant* constant) {
     return MapValue(constant, vmaps.back());
 }
 
-Constant* LLVMJit::addGlobal(const GlobalVariable* gv) {
+// Whether the trace can reference something at address in the host
+// directly.  Otherwise it goes through a GOT entry or stub, which works at
+// any distance.
+static bool isReachable(long address) {
+    return address && CodeHeap::get().canReach((const void*)address);
+}
+
+// A constant of address with the type of gv
+static Constant* boundAddress(const GlobalValue* gv, long address) {
+    auto i64 = Type::getInt64Ty(gv->getContext());
+    return ConstantExpr::getIntToPtr(ConstantInt::get(i64, address),
+                                     gv->getType());
+}
+
+Constant* LLVMJit::addGlobal(const GlobalVariable* gv, long address) {
+    if (!recording)
+        return nullptr;
+
+    // Constants whose address doesn't matter (string literals and the like)
+    // get copied into the trace, since that lets the optimizer see what's in
+    // them.  Anything that can be written to has to stay the program's own.
+    bool copied = gv->isConstant() && gv->hasAtLeastLocalUnnamedAddr()
+                  && gv->hasInitializer();
+    if (compiler->bindsSymbols() && !copied) {
+        auto c = boundAddress(gv, address);
+        map(gv, c);
+        return c;
+    }
+
     GlobalVariable* new_gv = cast<GlobalVariable>(module->getOrInsertGlobal(
         gv->getName(), cast<PointerType>(gv->getType())->getElementType()));
     new_gv->copyAttributesFrom(gv);
     new_gv->setSection(gv->getSection());
     new_gv->setVisibility(gv->getVisibility());
-    new_gv->setDSOLocal(gv->isDSOLocal());
+    new_gv->setDSOLocal(gv->hasLocalLinkage() || isReachable(address));
     new_gv->setLinkage(gv->getLinkage());
     new_gv->setConstant(gv->isConstant());
 
-    if (gv->hasAtLeastLocalUnnamedAddr()) {
-        if (gv->hasInitializer()) {
-            new_gv->setInitializer(cloneConstant(gv->getInitializer()));
-        }
+    // Copies are private, so that traces that get compiled together (see
+    // codegenBatch) don't define the same symbol twice.
+    if (copied) {
+        new_gv->setInitializer(cloneConstant(gv->getInitializer()));
+        new_gv->setLinkage(GlobalValue::PrivateLinkage);
+        new_gv->setDSOLocal(true);
     }
 
     map(gv, new_gv);
     return new_gv;
 }
 
-llvm::Function* LLVMJit::addFunction(const llvm::Function* func) {
+Constant* LLVMJit::addFunction(const llvm::Function* func, long address) {
+    if (!recording)
+        return nullptr;
+
+    if (compiler->bindsSymbols() && !func->isIntrinsic()) {
+        auto c = boundAddress(func, address);
+        map(func, c);
+        return c;
+    }
+
     Function* new_func = cast<Function>(module->getOrInsertFunction(
         func->getName(), cast<FunctionType>(cast<PointerType>(func->getType())
                                                 ->getElementType())));
     new_func->copyAttributesFrom(func);
     new_func->setSection(func->getSection());
     new_func->setVisibility(func->getVisibility());
-    new_func->setDSOLocal(func->isDSOLocal());
+    new_func->setDSOLocal(func->hasLocalLinkage() || isReachable(address));
     new_func->setLinkage(func->getLinkage());
     map(func, new_func);
     return new_func;
 }
 
 void LLVMJit::map(const llvm::Value* from, llvm::Value* to) {
+    if (!recording)
+        return;
     while (vmaps.back().count(to) > 0 && to != vmaps.back()[to]) {
         to = vmaps.back()[to];
     }
@@ -297,6 +1283,8 @@ void LLVMJit::map(const llvm::Value* from, llvm::Value* to) {
 }
 
 void LLVMJit::map(const llvm::Value* from, const llvm::Value* to) {
+    if (!recording)
+        return;
     if (isa<ConstantInt>(to)) {
         map(from,
             ConstantInt::get(to->getType(), cast<ConstantInt>(to)->getValue()));
@@ -306,22 +1294,148 @@ void LLVMJit::map(const llvm::Value* from, const llvm::Value* to) {
     map(from, vmaps.back()[to]);
 }
 
+// Scoped noalias metadata says that accesses in one scope don't alias those
+// in another, within one inlined copy of a function.  Every call that gets
+// traced into is a copy of its own, so like the inliner, each one gets fresh
+// scopes and domains in place of the callee's.  The outermost function only
+// appears once per trace and keeps its own.
+MDNode* LLVMJit::cloneAliasScopes(const MDNode* scope_list) {
+    auto& clones = alias_scopes.back();
+    auto operandName = [](const MDNode* node, unsigned i) {
+        if (node->getNumOperands() > i)
+            if (auto name = dyn_cast<MDString>(node->getOperand(i)))
+                return name->getString();
+        return StringRef();
+    };
+
+    MDBuilder builder(*llvm_context);
+    SmallVector<Metadata*, 4> scopes;
+    for (auto& op : scope_list->operands()) {
+        auto scope = cast<MDNode>(op);
+        auto& clone = clones[scope];
+        if (!clone) {
+            auto domain = cast<MDNode>(scope->getOperand(1));
+            auto& domain_clone = clones[domain];
+            if (!domain_clone)
+                domain_clone = builder.createAnonymousAliasScopeDomain(
+                    operandName(domain, 1));
+            clone = builder.createAnonymousAliasScope(domain_clone,
+                                                      operandName(scope, 2));
+        }
+        scopes.push_back(clone);
+    }
+    return MDNode::get(*llvm_context, scopes);
+}
+
+// Metadata comes along with the instruction: TBAA, !range, !nonnull and the
+// like describe the values and memory involved, which are the same in the
+// trace.  Only debug locations and noalias scopes depend on where the
+// instruction ends up.
 Value* LLVMJit::addInst(const Instruction* inst) {
+    if (!recording)
+        return nullptr;
     auto new_inst = inst->clone();
     cur_bb->getInstList().push_back(new_inst);
 
     map(inst, new_inst);
     RemapInstruction(new_inst, vmaps.back(),
                      RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
-    new_inst->setMetadata("dbg", nullptr);
+    // Past a loop header, the one copy of a callee stands for a new call on
+    // every iteration, and its scopes would claim that accesses from
+    // different iterations don't alias.  LLVM's inliner needs
+    // llvm.experimental.noalias.scope.decl for that; traces just drop them.
+    if (alias_scopes.size() > 1) {
+        bool in_loop = !loop_guard_starts.empty();
+        for (auto kind : { LLVMContext::MD_alias_scope,
+                           LLVMContext::MD_noalias }) {
+            if (auto scope_list = inst->getMetadata(kind))
+                new_inst->setMetadata(
+                    kind, in_loop ? nullptr : cloneAliasScopes(scope_list));
+        }
+    }
+    if (di_builder && inst->getDebugLoc())
+        new_inst->setDebugLoc(DebugLoc::appendInlinedAt(
+            inst->getDebugLoc(), inlined_at.back(), *llvm_context,
+            inlined_at_cache));
+    else
+        new_inst->setMetadata("dbg", nullptr);
+    if (new_inst->mayWriteToMemory())
+        may_have_side_effects = true;
+    num_instructions++;
     outs() << "Emitted " << *new_inst << '\n';
     return new_inst;
 }
 
-void LLVMJit::ensureConstant(Value v, long constant) {
-    if (isa<ConstantInt>(v))
-        return;
+bool LLVMJit::isConstant(Value v) {
+    return isa<Constant>(v);
+}
+
+llvm::Value* LLVMJit::toLong(llvm::Value* v, BasicBlock* bb) {
+    auto i64 = Type::getInt64Ty(*llvm_context);
+    auto type = v->getType();
+    if (type->isPointerTy())
+        return new PtrToIntInst(v, i64, "", bb);
+    RELEASE_ASSERT(type->isIntegerTy(), "unhandled live value type");
+    if (type->isIntegerTy(64))
+        return v;
+    // The interpreter keeps narrower integers sign-extended, except for i1
+    if (type->isIntegerTy(1))
+        return new ZExtInst(v, i64, "", bb);
+    return new SExtInst(v, i64, "", bb);
+}
 
+llvm::Value* LLVMJit::fromLong(llvm::Value* v, Type* type, BasicBlock* bb) {
+    if (type->isVoidTy())
+        return nullptr;
+    if (type->isPointerTy())
+        return new IntToPtrInst(v, type, "", bb);
+    RELEASE_ASSERT(type->isIntegerTy(), "unhandled return type");
+    if (type->isIntegerTy(64))
+        return v;
+    return new TruncInst(v, type, "", bb);
+}
+
+void LLVMJit::emitSideExit(BasicBlock* bb, SideExit* exit,
+                           const vector<llvm::Value*>& live_values) {
+    auto i64 = Type::getInt64Ty(*llvm_context);
+    auto i8_ptr = Type::getInt8PtrTy(*llvm_context);
+
+    // All exits share one spill buffer, sized for the largest of them.
+    if (!exit_buffer) {
+        exit_buffer = new AllocaInst(i64, 0, ConstantInt::get(i64, 0),
+                                     "exit_buffer");
+        func->front().getInstList().insert(func->front().getFirstInsertionPt(),
+                                           exit_buffer);
+    }
+    if (live_values.size() > num_exit_slots) {
+        num_exit_slots = live_values.size();
+        exit_buffer->setOperand(0, ConstantInt::get(i64, num_exit_slots));
+    }
+
+    for (int i = 0; i < live_values.size(); i++) {
+        auto slot = GetElementPtrInst::CreateInBounds(
+            exit_buffer, { ConstantInt::get(i64, i) }, "", bb);
+        new StoreInst(toLong(live_values[i], bb), slot, bb);
+    }
+
+    // Call through exit->handler rather than a fixed function, so that the
+    // handler can be swapped out after the trace has been compiled.
+    auto handler_type
+        = FunctionType::get(i64, { i8_ptr, i64->getPointerTo() }, false);
+    auto handler_ptr = ConstantExpr::getIntToPtr(
+        ConstantInt::get(i64, (intptr_t)&exit->handler),
+        handler_type->getPointerTo()->getPointerTo());
+    auto handler = new LoadInst(handler_ptr, "", bb);
+    auto exit_ptr
+        = ConstantExpr::getIntToPtr(ConstantInt::get(i64, (intptr_t)exit), i8_ptr);
+    auto result = CallInst::Create(handler, { exit_ptr, exit_buffer }, "", bb);
+
+    ReturnInst::Create(*llvm_context,
+                       fromLong(result, func->getReturnType(), bb), bb);
+}
+
+void LLVMJit::ensureConstant(Value v, long constant, SideExit* exit,
+                             const vector<Value>& live_values) {
     auto success_bb = BasicBlock::Create(*llvm_context, "", func);
     auto fail_bb = BasicBlock::Create(*llvm_context, "fail", func);
 
@@ -336,98 +1450,308 @@ void LLVMJit::ensureConstant(Value v, long constant) {
     auto cond = new ICmpInst(*cur_bb, CmpInst::ICMP_EQ, v,
                              check_val);
     outs() << "Emitted guard " << *cond << '\n';
-    BranchInst::Create(success_bb, fail_bb, cond, cur_bb);
+    // Guards only fail on what the recording didn't see.  Saying so lets the
+    // optimizers, and the vectorizers' cost models, treat the exits as cold
+    // and the trace itself as the hot path.
+    auto branch = BranchInst::Create(success_bb, fail_bb, cond, cur_bb);
+    branch->setMetadata(LLVMContext::MD_prof,
+                        MDBuilder(*llvm_context).createBranchWeights(2000, 1));
+    guarded_values.push_back(v);
 
-    auto abort = module->getOrInsertFunction(
-        "abort", FunctionType::get(Type::getVoidTy(*llvm_context), false));
-    auto call = CallInst::Create(abort, "", fail_bb);
-    call->setDoesNotReturn();
-    new UnreachableInst(*llvm_context, fail_bb);
+    exit->restartable = !may_have_side_effects;
+    emitSideExit(fail_bb, exit, live_values);
 
     cur_bb = success_bb;
 }
 
+BasicBlock* LLVMJit::startLoopHeader() {
+    auto header = BasicBlock::Create(*llvm_context, "loop", func);
+    BranchInst::Create(header, cur_bb);
+    cur_bb = header;
 
-Value* LLVMJit::call(Value ptr, const std::vector<Value>& args) {
-    return CallInst::Create(ptr, args);
+    loop_guard_starts[header] = guarded_values.size();
+    // Guards inside the loop can fail after earlier iterations had side
+    // effects.
+    may_have_side_effects = true;
+    return header;
+}
+
+Value* LLVMJit::phi(BasicBlock* header, Value initial) {
+    auto preheader = header->getSinglePredecessor();
+    RELEASE_ASSERT(preheader, "phis have to be added before the back edge");
+    auto r = PHINode::Create(initial->getType(), 2, "", header);
+    r->addIncoming(initial, preheader);
+    return r;
 }
 
-void LLVMJit::optimizeFunc() {
-    llvm::legacy::FunctionPassManager fpm(module.get());
+static bool dependsOn(llvm::Value* v, llvm::Value* on) {
+    vector<llvm::Value*> worklist = { v };
+    SmallPtrSet<llvm::Value*, 16> visited;
+    while (!worklist.empty()) {
+        auto cur = worklist.back();
+        worklist.pop_back();
+        if (cur == on)
+            return true;
+
+        auto inst = dyn_cast<Instruction>(cur);
+        if (!inst || !visited.insert(inst).second)
+            continue;
+        for (auto& op : inst->operands())
+            worklist.push_back(op);
+    }
+    return false;
+}
 
-    //fpm.add(new DataLayoutPass());
-    //fpm.add(createBasicAliasAnalysisPass());
-    //fpm.add(createTypeBasedAliasAnalysisPass());
+bool LLVMJit::isSpecializedOn(BasicBlock* header, Value v) {
+    for (int i = loop_guard_starts[header]; i < guarded_values.size(); i++) {
+        auto guarded = guarded_values[i];
+        // Guards on conditions only pin down the path through the loop,
+        // which every iteration of the trace has to take anyway.
+        if (guarded->getType()->isIntegerTy(1))
+            continue;
+        if (dependsOn(guarded, v))
+            return true;
+    }
+    return false;
+}
 
-    if (0) {
-        fpm.add(createInstructionCombiningPass());
-        fpm.add(createReassociatePass());
-        fpm.add(createGVNPass());
-    } else {
-        fpm.add(llvm::createEarlyCSEPass());                   // Catch trivial redundancies
-        fpm.add(llvm::createJumpThreadingPass());              // Thread jumps.
-        fpm.add(llvm::createCorrelatedValuePropagationPass()); // Propagate conditionals
-        fpm.add(llvm::createCFGSimplificationPass());          // Merge & remove BBs
-        fpm.add(llvm::createInstructionCombiningPass());       // Combine silly seq's
+void LLVMJit::closeLoop(BasicBlock* header,
+                        const vector<pair<Value, Value>>& backedge_values) {
+    for (auto& p : backedge_values)
+        cast<PHINode>(p.first)->addIncoming(p.second, cur_bb);
+    BranchInst::Create(header, cur_bb);
+    outs() << "Closed loop " << header->getName() << '\n';
 
-        fpm.add(llvm::createTailCallEliminationPass()); // Eliminate tail calls
-        fpm.add(llvm::createCFGSimplificationPass());   // Merge & remove BBs
-        fpm.add(llvm::createReassociatePass());         // Reassociate expressions
-        fpm.add(llvm::createLoopRotatePass());          // Rotate Loop
-        fpm.add(llvm::createLICMPass());                // Hoist loop invariants
-        fpm.add(llvm::createLoopUnswitchPass(true /*optimize_for_size*/));
-        fpm.add(llvm::createInstructionCombiningPass());
-        fpm.add(llvm::createIndVarSimplifyPass()); // Canonicalize indvars
-        fpm.add(llvm::createLoopIdiomPass());      // Recognize idioms like memset.
-        fpm.add(llvm::createLoopDeletionPass());   // Delete dead loops
+    recording = false;
+}
 
-        fpm.add(llvm::createLoopUnrollPass()); // Unroll small loops
+Value* LLVMJit::call(Value ptr, const std::vector<Value>& args) {
+    return CallInst::Create(ptr, args);
+}
 
-        fpm.add(llvm::createGVNPass());       // Remove redundancies
-        fpm.add(llvm::createMemCpyOptPass()); // Remove memcpy / form memset
-        fpm.add(llvm::createSCCPPass());      // Constant prop with SCCP
+// The code pointer gets loaded on every call rather than baked in, so that
+// calls pick up the callee's tier-ups, and go back to the stub if it gets
+// evicted.
+Value* LLVMJit::callTrace(const CallInst* call, const vector<Value>& args,
+                          void* const* trace, void* stub,
+                          const void* stub_arg) {
+    if (!recording)
+        return nullptr;
+
+    auto i64 = Type::getInt64Ty(*llvm_context);
+    auto i8_ptr = Type::getInt8PtrTy(*llvm_context);
+    auto type = call->getFunctionType();
+    auto return_type = type->getReturnType();
+
+    auto trace_ptr = ConstantExpr::getIntToPtr(
+        ConstantInt::get(i64, (intptr_t)trace),
+        type->getPointerTo()->getPointerTo());
+    auto code = new LoadInst(trace_ptr, "", false, 8, AtomicOrdering::Acquire,
+                             SyncScope::System, cur_bb);
+
+    auto compiled_bb = BasicBlock::Create(*llvm_context, "", func);
+    auto stub_bb = BasicBlock::Create(*llvm_context, "", func);
+    auto done_bb = BasicBlock::Create(*llvm_context, "", func);
+    auto cond = new ICmpInst(*cur_bb, CmpInst::ICMP_NE, code,
+                             ConstantPointerNull::get(type->getPointerTo()));
+    BranchInst::Create(compiled_bb, stub_bb, cond, cur_bb);
+
+    auto compiled_result = CallInst::Create(code, args, "", compiled_bb);
+    compiled_result->setCallingConv(call->getCallingConv());
+    BranchInst::Create(done_bb, compiled_bb);
+
+    auto stub_type = FunctionType::get(i64, { i8_ptr }, true);
+    auto stub_ptr = ConstantExpr::getIntToPtr(
+        ConstantInt::get(i64, (intptr_t)stub), stub_type->getPointerTo());
+    vector<llvm::Value*> stub_args{ ConstantExpr::getIntToPtr(
+        ConstantInt::get(i64, (intptr_t)stub_arg), i8_ptr) };
+    for (auto arg : args)
+        stub_args.push_back(toLong(arg, stub_bb));
+    auto stub_result
+        = fromLong(CallInst::Create(stub_ptr, stub_args, "", stub_bb),
+                   return_type, stub_bb);
+    BranchInst::Create(done_bb, stub_bb);
+
+    cur_bb = done_bb;
+    may_have_side_effects = true;
+    num_instructions++;
+    outs() << "Emitted call to the trace at " << (void*)trace << '\n';
+    if (return_type->isVoidTy())
+        return nullptr;
+
+    auto result = PHINode::Create(return_type, 2, "", done_bb);
+    result->addIncoming(compiled_result, compiled_bb);
+    result->addIncoming(stub_result, stub_bb);
+    map(call, result);
+    return result;
+}
 
-        // Run instcombine after redundancy elimination to exploit opportunities
-        // opened up by them.
-        fpm.add(llvm::createInstructionCombiningPass());
-        fpm.add(llvm::createJumpThreadingPass()); // Thread jumps
-        fpm.add(llvm::createCorrelatedValuePropagationPass());
-        fpm.add(llvm::createDeadStoreEliminationPass()); // Delete dead stores
+// Pipelines that can be asked for by name.  "full" is what traces have always
+// been optimized with.
+static string namedPipeline(const string& name) {
+    static const string full
+        = "early-cse,jump-threading,correlated-propagation,simplify-cfg,"
+          "instcombine,tailcallelim,simplify-cfg,reassociate,"
+          "require<opt-remark-emit>,loop(rotate,licm,unswitch),"
+          "instcombine,loop(indvars,loop-idiom,loop-deletion),unroll,"
+          "gvn,memcpyopt,sccp,instcombine,jump-threading,"
+          "correlated-propagation,dse,adce,simplify-cfg,instcombine,"
+          "simplify-cfg";
+
+    if (name == "baseline")
+        return "early-cse,simplify-cfg";
+    if (name == "full")
+        return full;
+    // The vectorizers go last, as in LLVM's own pipelines, once loops have
+    // been rotated and guards that don't depend on the loop hoisted out of
+    // it.  A trace loop only ever leaves through its guards, so the loop
+    // vectorizer can only take ones where that's the latch; straight-line
+    // runs of similar arithmetic are the SLP vectorizer's.  Their costs come
+    // from the TargetMachine, which knows what the host has, weighted by the
+    // branch weights on guards (see ensureConstant), which keep side exits
+    // out of the hot path.
+    if (name == "vectorize")
+        return full
+               + ",loop-vectorize,loop-load-elim,instcombine,simplify-cfg,"
+                 "slp-vectorizer,instcombine,simplify-cfg";
+    return "";
+}
 
-        fpm.add(llvm::createLoopRerollPass());
-        // fpm.add(llvm::createSLPVectorizerPass());   // Vectorize parallel scalar chains.
+// Pipelines are a name from namedPipeline, O1 to O3 for LLVM's own function
+// simplification pipeline, or a list of function passes in the same syntax
+// as opt -passes.
+static void buildPipeline(PassBuilder& pb, FunctionPassManager& fpm,
+                          const string& pipeline) {
+    if (pipeline == "O1" || pipeline == "O2" || pipeline == "O3") {
+        auto level = pipeline == "O1"
+                         ? PassBuilder::O1
+                         : pipeline == "O2" ? PassBuilder::O2 : PassBuilder::O3;
+        fpm = pb.buildFunctionSimplificationPipeline(
+            level, PassBuilder::ThinLTOPhase::None);
+        return;
+    }
 
+    auto named = namedPipeline(pipeline);
+    if (auto err = pb.parsePassPipeline(fpm, named.empty() ? pipeline : named))
+        RELEASE_ASSERT(0, "bad pipeline '%s': %s", pipeline.c_str(),
+                       toString(move(err)).c_str());
+}
 
-        fpm.add(llvm::createAggressiveDCEPass());        // Delete dead instructions
-        fpm.add(llvm::createCFGSimplificationPass());    // Merge & remove BBs
-        fpm.add(llvm::createInstructionCombiningPass()); // Clean up after everything.
+void LLVMCompiler::setPipeline(Tier tier, const string& pipeline) {
+    // Check it now, rather than from a compile thread later on
+    PassBuilder pb;
+    FunctionPassManager fpm;
+    buildPipeline(pb, fpm, pipeline);
+    pipelines[tier] = pipeline;
+}
 
-        // fpm.add(llvm::createBarrierNoopPass());
-        // fpm.add(llvm::createLoopVectorizePass(DisableUnrollLoops, LoopVectorize));
-        fpm.add(llvm::createInstructionCombiningPass());
-        fpm.add(llvm::createCFGSimplificationPass());
+void LLVMCompiler::optimizeFunction(Function* func, TargetMachine& tm,
+                                    const string& pipeline) {
+    // Pass managers and adaptors go through the callbacks too, so their
+    // times include those of the passes they run.
+    typedef chrono::steady_clock Clock;
+    vector<Clock::time_point> started;
+    unordered_map<string, PassTime> times;
+    auto stop = [&](StringRef pass) {
+        auto& time = times[pass.str()];
+        time.seconds += chrono::duration<double>(Clock::now() - started.back())
+                            .count();
+        time.runs++;
+        started.pop_back();
+    };
+
+    PassInstrumentationCallbacks callbacks;
+    if (time_passes) {
+        callbacks.registerBeforePassCallback([&](StringRef, Any) {
+            started.push_back(Clock::now());
+            return true;
+        });
+        callbacks.registerAfterPassCallback(
+            [&](StringRef pass, Any) { stop(pass); });
+        callbacks.registerAfterPassInvalidatedCallback(
+            [&](StringRef pass) { stop(pass); });
     }
 
-    fpm.doInitialization();
-
-    bool changed = fpm.run(*func);
+    PassBuilder pb(&tm, None, &callbacks);
+    LoopAnalysisManager lam;
+    FunctionAnalysisManager fam;
+    CGSCCAnalysisManager cgam;
+    ModuleAnalysisManager mam;
+    // Traces are mostly loads and stores, so GVN, LICM and DSE don't get
+    // far without alias analysis.
+    fam.registerPass([&] { return pb.buildDefaultAAPipeline(); });
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+    FunctionPassManager fpm;
+    buildPipeline(pb, fpm, pipeline);
+    fpm.run(*func, fam);
+
+    if (time_passes) {
+        lock_guard<mutex> guard(timing_lock);
+        for (auto& p : times) {
+            pass_times[p.first].seconds += p.second.seconds;
+            pass_times[p.first].runs += p.second.runs;
+        }
+    }
 }
 
-void* LLVMJit::finish(Value retval) {
-    ReturnInst::Create(*llvm_context, retval, cur_bb);
+void LLVMCompiler::printPassTimes() {
+    lock_guard<mutex> guard(timing_lock);
+    vector<pair<string, PassTime>> sorted(pass_times.begin(),
+                                          pass_times.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+        return a.second.seconds > b.second.seconds;
+    });
+
+    errs() << "Time spent optimizing traces, by pass:\n";
+    for (auto& p : sorted)
+        errs() << format("%10.3fms %7ld  ", p.second.seconds * 1000,
+                         p.second.runs)
+               << p.first << '\n';
+}
 
-    outs() << *module << '\n';
+void LLVMJit::finish(Value retval, LLVMCompiler::Callback publish,
+                     const long* hotness, const void* owner) {
+    // A closed loop already terminated the trace
+    if (recording) {
+        if (is_bridge) {
+            auto i64 = Type::getInt64Ty(*llvm_context);
+            retval
+                = retval ? toLong(retval, cur_bb) : ConstantInt::get(i64, 0);
+        }
+        ReturnInst::Create(*llvm_context, retval, cur_bb);
+    }
 
-    RELEASE_ASSERT(!verifyFunction(*func, &errs()),
-                   "function failed to verify");
+    if (di_builder) {
+        // Every compile unit that locations came from has to be listed
+        auto units = module->getOrInsertNamedMetadata("llvm.dbg.cu");
+        SmallPtrSet<MDNode*, 4> listed;
+        for (auto unit : units->operands())
+            listed.insert(unit);
+        for (auto& bb : *func) {
+            for (auto& inst : bb) {
+                for (DILocation* loc = inst.getDebugLoc(); loc;
+                     loc = loc->getInlinedAt()) {
+                    auto unit = loc->getScope()->getSubprogram()->getUnit();
+                    if (unit && listed.insert(unit).second)
+                        units->addOperand(unit);
+                }
+            }
+        }
+        di_builder->finalize();
+    }
 
-    optimizeFunc();
     outs() << *module << '\n';
 
     RELEASE_ASSERT(!verifyFunction(*func, &errs()),
                    "function failed to verify");
 
-    return compiler->compile(move(module), func->getName());
+    compiler->compile(move(module), func->getName(), move(publish), hotness,
+                      owner);
 }
 
 
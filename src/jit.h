@@ -1,13 +1,22 @@
 #ifndef _DCOP_JIT_H
 #define _DCOP_JIT_H
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <list>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/Transforms/Utils/ValueMapper.h" // For ValueToValueMapTy
 
 namespace llvm {
+class AllocaInst;
 class BasicBlock;
 class Constant;
 class Function;
@@ -15,21 +24,196 @@ class GlobalVariable;
 class Instruction;
 class LLVMContext;
 class Module;
-class Value;
+class TargetMachine;
 class Type;
+class Value;
 }
 
 namespace dcop {
 
+// The interpreter state needed to resume execution when a guard in a trace
+// fails.  The trace spills its live values into an array and passes it, along
+// with the exit itself, to the exit's handler.
+struct SideExit {
+    typedef long (*Handler)(SideExit* exit, long* live_values);
+
+    struct ExitValue {
+        int slot;                 // -1 for varargs
+        llvm::Type* type;         // type of the value in the trace
+        int live_index;           // index into live_values, or -1 if constant
+        long constant;
+    };
+
+    struct Frame {
+        const llvm::Function* function;
+        int pc;         // index of the instruction to resume at
+        int prev_block; // for picking phi inputs, or -1
+        std::vector<ExitValue> values;
+        std::vector<ExitValue> vaargs;
+    };
+
+    Handler handler;
+    std::vector<Frame> frames; // innermost first
+
+    // Nothing observable happened in the trace before this guard, so it is
+    // safe to just rerun the original function.
+    bool restartable;
+
+    long num_exits;
+
+    // What the trace this exit is in (and any bridge off of it) gets evicted
+    // with
+    const void* owner;
+};
+
 class LLVMJitCompiler;
 class LLVMCompiler {
+public:
+    // Receives the address of the compiled function, or nullptr if there
+    // was no room left for it in the CodeHeap
+    typedef std::function<void(void*)> Callback;
+
+    enum Tier {
+        Baseline,  // few passes and FastISel, counts calls to tier up
+        Optimized, // the full pipeline
+    };
+
 private:
     std::unique_ptr<LLVMJitCompiler> jit;
+    std::mutex jit_lock; // the ORC layers aren't thread-safe
+
+    struct TierUp;
+    struct CompileJob {
+        std::string bitcode;
+        std::string funcname;
+        Callback done;
+        const long* hotness; // jobs with the highest count go first
+        TierUp* tier_up;     // set for baseline compiles
+        const void* owner;
+        // The tier's pipeline when the trace was recorded; compile threads
+        // never read the settings
+        std::string pipeline;
+    };
+
+    // Baseline code bumps count on every call, and queues job (the optimized
+    // compile) once it hits tier_up_threshold.  Freed when job.owner gets
+    // evicted.
+    struct TierUp {
+        LLVMCompiler* compiler;
+        CompileJob job;
+        long count;
+    };
+
+    bool async;
+    int num_threads;
+    int max_queued;
+    int max_batch; // traces per codegen run
+    // Started by the first background compile; each has its own
+    // LLVMContext and TargetMachine.
+    std::vector<std::thread> workers;
+    std::mutex queue_lock;
+    // Signaled when jobs are added, taken or done
+    std::condition_variable queue_cv;
+    std::deque<CompileJob> queue;
+    bool shutting_down;
+    long num_pending;
+    long num_completed;
+
+    // Objects get cached here when it's set
+    std::string cache_dir;
+    long num_cache_hits; // protected by jit_lock
+
+    // The objects compiled for each owner, and how many owners each object
+    // has.  Protected by jit_lock.
+    std::unordered_map<const void*, std::vector<uint64_t>> owned_objects;
+    std::unordered_map<uint64_t, int> object_owners;
+
+    long tier_up_threshold; // 0 if tiering is off
+    std::vector<std::unique_ptr<TierUp>> tier_ups;
+
+    std::string pipelines[2]; // indexed by Tier
+
+    struct PassTime {
+        double seconds = 0;
+        long runs = 0;
+    };
+    bool time_passes;
+    std::mutex timing_lock;
+    std::unordered_map<std::string, PassTime> pass_times;
+
+    bool bind_symbols;
+    bool debug_info;
+
+    std::string target_cpu;
+
+    void* codegen(std::unique_ptr<llvm::Module> module, const CompileJob& job,
+                  llvm::TargetMachine& tm, bool verbose);
+    void addOwner(const void* owner, uint64_t key);
+    void optimizeFunction(llvm::Function* func, llvm::TargetMachine& tm,
+                          const std::string& pipeline);
+    void codegenBatch(std::vector<CompileJob>& jobs,
+                      llvm::LLVMContext& context, llvm::TargetMachine& tm);
+    void enqueue(CompileJob job);
+    void workerLoop();
+    static void tierUp(void* tier_up); // called from baseline code
+
 public:
     LLVMCompiler();
     ~LLVMCompiler();
 
-    void* compile(std::unique_ptr<llvm::Module> module, std::string funcname);
+    // In async mode compile() returns right away (unless the queue is full)
+    // and the callback gets run on a compile thread once the code is ready.
+    void setAsync(bool async) { this->async = async; }
+    bool isAsync() const { return async; }
+    // Only has an effect before the first asynchronous compile
+    void setNumThreads(int num_threads) { this->num_threads = num_threads; }
+    void setMaxQueued(int max_queued) { this->max_queued = max_queued; }
+    void setMaxBatch(int max_batch) { this->max_batch = max_batch; }
+    // Compile traces at the baseline tier first, and recompile them fully
+    // (in the background) once they've been called this many times.
+    void setTierUpThreshold(long threshold) { tier_up_threshold = threshold; }
+
+    // See buildPipeline() in jit.cpp for what the pipeline can be.  Applies
+    // to traces recorded afterwards, including their tier-ups.
+    void setPipeline(Tier tier, const std::string& pipeline);
+    // Per-pass optimization times get printed when the compiler goes away
+    void setTimePasses(bool time_passes) { this->time_passes = time_passes; }
+    void printPassTimes();
+
+    // Whether traces refer to host globals and functions by address instead
+    // of by name.  Read when traces are recorded.
+    void setBindSymbols(bool bind_symbols) {
+        this->bind_symbols = bind_symbols;
+    }
+    bool bindsSymbols() const { return bind_symbols; }
+
+    // Whether traces keep the debug locations of what they were recorded
+    // from.  Also registers compiled code with gdb from then on.
+    void setDebugInfo(bool debug_info);
+    bool emitsDebugInfo() const { return debug_info; }
+
+    // Report compiled code to perf (see PerfOutput)
+    void setPerfMap(bool enabled);
+    void setJitDumpDir(const std::string& dir);
+
+    void compile(std::unique_ptr<llvm::Module> module, std::string funcname,
+                 Callback done, const long* hotness = nullptr,
+                 const void* owner = nullptr);
+    // Frees everything compiled for owner, including code that has since
+    // been replaced by a higher tier.  Nothing may still be running it.
+    void evict(const void* owner);
+    void waitForCompiles();
+
+    long numPending();
+    long numCompleted();
+
+    // Reuses objects compiled by earlier processes, skipping optimization and
+    // codegen.  Has to be set before the first compile.
+    void setCacheDir(const std::string& dir);
+    long numCacheHits();
+
+    // The host's, along with whatever features it has
+    const std::string& targetCPU() const { return target_cpu; }
 };
 
 class LLVMJit {
@@ -43,23 +227,64 @@ private:
 
     std::list<llvm::ValueToValueMapTy> vmaps;
 
+    // Only set when the compiler wants debug info.  The trace gets a
+    // subprogram of its own, and everything in it is inlined into that.
+    std::unique_ptr<llvm::DIBuilder> di_builder;
+    // What the locations in each scope are inlined at
+    std::vector<llvm::DILocation*> inlined_at;
+    llvm::DenseMap<const llvm::MDNode*, llvm::MDNode*> inlined_at_cache;
+
+    // Copies of the noalias scopes used in each scope (see cloneAliasScopes)
+    std::vector<llvm::DenseMap<const llvm::MDNode*, llvm::MDNode*>>
+        alias_scopes;
+
+    // Bridges start from a side exit rather than a function entry, and have
+    // the signature of SideExit::Handler.
+    bool is_bridge;
+
+    llvm::AllocaInst* exit_buffer;
+    int num_exit_slots;
+    bool may_have_side_effects;
+
+    // Cleared once a loop has been closed: the trace is complete at that
+    // point, and everything after the loop is reached through its exits.
+    bool recording;
+
+    int num_instructions;
+
+    std::vector<llvm::Value*> guarded_values;
+    std::unordered_map<llvm::BasicBlock*, int> loop_guard_starts;
+
     static int num_functions;
     static std::string getUniqueFunctionName(std::string nameprefix);
 
     llvm::Constant* cloneConstant(const llvm::Constant* constant);
+    void startDebugInfo(const llvm::Function* orig_function,
+                        const std::string& name);
+    llvm::DILocation* inlinedAt(const llvm::Instruction* call_site);
+    llvm::MDNode* cloneAliasScopes(const llvm::MDNode* scope_list);
 
-    void optimizeFunc();
+    llvm::Value* toLong(llvm::Value* v, llvm::BasicBlock* bb);
+    llvm::Value* fromLong(llvm::Value* v, llvm::Type* type,
+                          llvm::BasicBlock* bb);
+    void emitSideExit(llvm::BasicBlock* bb, SideExit* exit,
+                      const std::vector<llvm::Value*>& live_values);
 
 public:
     LLVMJit(const llvm::Function* orig_function,
             llvm::LLVMContext* llvm_context, LLVMCompiler* compiler);
+    LLVMJit(const SideExit* exit, llvm::LLVMContext* llvm_context,
+            LLVMCompiler* compiler);
 
-    void startScope();
+    // call_site is the call that the new scope is for, if any
+    void startScope(const llvm::Instruction* call_site = nullptr);
     void endScope();
 
     typedef llvm::Value* Value;
+    typedef llvm::BasicBlock* Block;
 
     Value arg(int argnum);
+    Value liveValue(int index, llvm::Type* type);
     Value constantInt(long value, llvm::Type* type);
     Value alloca(llvm::Type* type);
 
@@ -67,18 +292,85 @@ public:
     Value gepInBounds(Value v, std::vector<int> indices);
     void store(Value v, Value ptr);
 
-    llvm::Constant* addGlobal(const llvm::GlobalVariable* gv);
-    llvm::Function* addFunction(const llvm::Function* func);
+    // address is where the global or function is in this process
+    llvm::Constant* addGlobal(const llvm::GlobalVariable* gv, long address);
+    llvm::Constant* addFunction(const llvm::Function* func, long address);
 
     void map(const llvm::Value* from, llvm::Value* to);
     void map(const llvm::Value* from, const llvm::Value* to);
     Value addInst(const llvm::Instruction* inst);
 
-    void ensureConstant(Value v, long constant);
+    bool isRecording() const { return recording; }
+    int traceSize() const { return num_instructions; }
+    bool isConstant(Value v);
+    void ensureConstant(Value v, long constant, SideExit* exit,
+                        const std::vector<Value>& live_values);
+
+    Block startLoopHeader();
+    Value phi(Block header, Value initial);
+    // Whether a guard inside the loop pinned down something computed from v
+    bool isSpecializedOn(Block header, Value v);
+    void closeLoop(Block header,
+                   const std::vector<std::pair<Value, Value>>& backedge_values);
 
     Value call(Value ptr, const std::vector<Value>& args);
+    // Emits call as a call to the code at *trace, which has the callee's
+    // signature, or to stub(stub_arg, args...) while there is none, with
+    // the arguments and result passed as longs.
+    Value callTrace(const llvm::CallInst* call, const std::vector<Value>& args,
+                    void* const* trace, void* stub, const void* stub_arg);
+
+    // Hands the trace off to the compiler; publish gets its address.  The
+    // compiler prefers traces whose hotness counter is higher.
+    void finish(Value retval, LLVMCompiler::Callback publish,
+                const long* hotness = nullptr, const void* owner = nullptr);
+};
+
+// A Jit that records nothing, for running the interpreter without tracing
+// (e.g. to finish a call after one of a trace's guards failed).
+class NullJit {
+public:
+    typedef llvm::Value* Value;
+    typedef llvm::BasicBlock* Block;
+
+    void startScope(const llvm::Instruction* call_site = nullptr) {}
+    void endScope() {}
+
+    Value liveValue(int index, llvm::Type* type) { return nullptr; }
+    Value constantInt(long value, llvm::Type* type) { return nullptr; }
+    Value alloca(llvm::Type* type) { return nullptr; }
+
+    Value bitcast(Value v, llvm::Type* type) { return nullptr; }
+    Value gepInBounds(Value v, std::vector<int> indices) { return nullptr; }
+    void store(Value v, Value ptr) {}
+
+    llvm::Constant* addGlobal(const llvm::GlobalVariable* gv, long address) {
+        return nullptr;
+    }
+    llvm::Constant* addFunction(const llvm::Function* func, long address) {
+        return nullptr;
+    }
+
+    void map(const llvm::Value* from, llvm::Value* to) {}
+    void map(const llvm::Value* from, const llvm::Value* to) {}
+    Value addInst(const llvm::Instruction* inst) { return nullptr; }
+    Value callTrace(const llvm::CallInst* call, const std::vector<Value>& args,
+                    void* const* trace, void* stub, const void* stub_arg) {
+        return nullptr;
+    }
+
+    bool isRecording() const { return false; }
+    int traceSize() const { return 0; }
+    bool isConstant(Value v) { return true; }
+    void ensureConstant(Value v, long constant, SideExit* exit,
+                        const std::vector<Value>& live_values) {}
 
-    void* finish(Value retval);
+    Block startLoopHeader() { return nullptr; }
+    Value phi(Block header, Value initial) { return nullptr; }
+    bool isSpecializedOn(Block header, Value v) { return false; }
+    void closeLoop(Block header,
+                   const std::vector<std::pair<Value, Value>>& backedge_values) {
+    }
 };
 
 }
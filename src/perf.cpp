@@ -0,0 +1,219 @@
+#include "perf.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "llvm/BinaryFormat/ELF.h"
+#include "llvm/DebugInfo/DWARF/DWARFContext.h"
+#include "llvm/Object/SymbolSize.h"
+
+#include "common.h"
+
+using namespace llvm;
+using namespace std;
+
+namespace dcop {
+
+// The jitdump format, as described by
+// tools/perf/Documentation/jitdump-specification.txt in the kernel tree
+namespace {
+struct JitDumpHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+enum : uint32_t {
+    JIT_CODE_LOAD = 0,
+    JIT_CODE_DEBUG_INFO = 2,
+};
+
+struct JitDumpRecord {
+    uint32_t id;
+    uint32_t total_size; // including whatever follows the fixed part
+    uint64_t timestamp;
+};
+
+// Followed by the name and then the code
+struct JitCodeLoad {
+    JitDumpRecord header;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+};
+
+// Followed by the entries, each of which is followed by its file name.
+// Has to come before the load of the code it describes.
+struct JitDebugInfo {
+    JitDumpRecord header;
+    uint64_t code_addr;
+    uint64_t nr_entry;
+};
+
+struct JitDebugEntry {
+    uint64_t code_addr;
+    uint32_t line;
+    uint32_t discrim;
+};
+}
+
+// perf record -k 1 timestamps samples with the same clock
+static uint64_t timestamp() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+PerfOutput::~PerfOutput() {
+    if (perf_map)
+        fclose(perf_map);
+    if (jitdump)
+        fclose(jitdump);
+}
+
+void PerfOutput::openPerfMap() {
+    lock_guard<mutex> guard(lock);
+    if (perf_map)
+        return;
+
+    string path = "/tmp/perf-" + to_string(getpid()) + ".map";
+    perf_map = fopen(path.c_str(), "w");
+    RELEASE_ASSERT(perf_map, "couldn't open %s", path.c_str());
+}
+
+void PerfOutput::openJitDump(const string& dir) {
+    lock_guard<mutex> guard(lock);
+    if (jitdump)
+        return;
+
+    string path = dir + "/jit-" + to_string(getpid()) + ".dump";
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+    RELEASE_ASSERT(fd >= 0, "couldn't open %s", path.c_str());
+    jitdump = fdopen(fd, "w+");
+    RELEASE_ASSERT(jitdump, "couldn't open %s", path.c_str());
+
+    // perf finds the file through this mapping showing up in the trace, so
+    // it stays mapped for as long as the process is around.
+    void* marker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC,
+                        MAP_PRIVATE, fd, 0);
+    RELEASE_ASSERT(marker != MAP_FAILED, "couldn't map %s", path.c_str());
+
+    JitDumpHeader header = {};
+    header.magic = 0x4A695444; // "JiTD"
+    header.version = 1;
+    header.total_size = sizeof(header);
+    header.elf_mach = ELF::EM_X86_64;
+    header.pid = getpid();
+    header.timestamp = timestamp();
+    fwrite(&header, sizeof(header), 1, jitdump);
+    fflush(jitdump);
+}
+
+vector<PerfOutput::Code>
+PerfOutput::readObject(const object::ObjectFile& obj,
+                       const RuntimeDyld::LoadedObjectInfo& info) {
+    // A copy of the object that has its sections where they got loaded
+    auto debug_obj = info.getObjectForDebug(obj);
+    const object::ObjectFile& loaded
+        = debug_obj.getBinary() ? *debug_obj.getBinary() : obj;
+    unique_ptr<DIContext> context;
+    if (wantsLines())
+        context = DWARFContext::create(loaded);
+
+    vector<Code> r;
+    for (auto& p : object::computeSymbolSizes(loaded)) {
+        auto sym = p.first;
+        if (cantFail(sym.getType()) != object::SymbolRef::ST_Function)
+            continue;
+
+        Code code;
+        code.name = cantFail(sym.getName());
+        code.address = cantFail(sym.getAddress());
+        code.size = p.second;
+        if (context) {
+            DILineInfoSpecifier spec(
+                DILineInfoSpecifier::FileLineInfoKind::AbsoluteFilePath);
+            for (auto& l : context->getLineInfoForAddressRange(
+                     code.address, code.size, spec))
+                code.lines.push_back(
+                    Line{ l.first, l.second.Line, l.second.FileName });
+        }
+        r.push_back(move(code));
+    }
+    return r;
+}
+
+void PerfOutput::addCode(const Code& code) {
+    lock_guard<mutex> guard(lock);
+    // Only ever appended to; see removeCode for what that means for ranges
+    // that get reused
+    if (perf_map) {
+        fprintf(perf_map, "%lx %lx %s\n", code.address, code.size,
+                code.name.c_str());
+        fflush(perf_map);
+    }
+    if (jitdump)
+        writeJitDump(code);
+}
+
+void PerfOutput::removeCode(const Code& code) {
+    Code freed;
+    freed.name = "[freed] " + code.name;
+    freed.address = code.address;
+    freed.size = code.size;
+    addCode(freed);
+}
+
+void PerfOutput::writeJitDump(const Code& code) {
+    auto& name = code.name;
+    auto& lines = code.lines;
+    uint64_t address = code.address;
+    uint64_t size = code.size;
+    uint64_t now = timestamp();
+
+    if (!lines.empty()) {
+        JitDebugInfo info = {};
+        info.header.id = JIT_CODE_DEBUG_INFO;
+        info.header.total_size = sizeof(info);
+        for (auto& line : lines)
+            info.header.total_size
+                += sizeof(JitDebugEntry) + line.file.size() + 1;
+        info.header.timestamp = now;
+        info.code_addr = address;
+        info.nr_entry = lines.size();
+        fwrite(&info, sizeof(info), 1, jitdump);
+
+        for (auto& line : lines) {
+            JitDebugEntry entry = { line.address, line.line, 0 };
+            fwrite(&entry, sizeof(entry), 1, jitdump);
+            fwrite(line.file.c_str(), line.file.size() + 1, 1, jitdump);
+        }
+    }
+
+    JitCodeLoad load = {};
+    load.header.id = JIT_CODE_LOAD;
+    load.header.total_size = sizeof(load) + name.size() + 1 + size;
+    load.header.timestamp = now;
+    load.pid = getpid();
+    load.tid = syscall(SYS_gettid);
+    load.vma = address;
+    load.code_addr = address;
+    load.code_size = size;
+    load.code_index = code_index++;
+    fwrite(&load, sizeof(load), 1, jitdump);
+    fwrite(name.c_str(), name.size() + 1, 1, jitdump);
+    fwrite((const void*)address, size, 1, jitdump);
+    fflush(jitdump);
+}
+}
@@ -0,0 +1,71 @@
+#ifndef _DCOP_PERF_H
+#define _DCOP_PERF_H
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+
+namespace dcop {
+
+// Tells perf about jitted code, which it otherwise only sees as anonymous
+// memory.  There are two ways of doing that:
+//
+// - /tmp/perf-<pid>.map, which perf report reads symbols from.
+// - A jitdump file, which also has the code itself and line numbers.  It
+//   needs `perf record -k 1`, and `perf inject --jit` on the result, but
+//   then perf annotate works on traces.
+class PerfOutput {
+public:
+    struct Line {
+        uint64_t address;
+        unsigned line;
+        std::string file;
+    };
+    struct Code {
+        std::string name;
+        uint64_t address;
+        uint64_t size;
+        std::vector<Line> lines; // only read for jitdump
+    };
+
+    PerfOutput() {}
+    PerfOutput(const PerfOutput&) = delete;
+    ~PerfOutput();
+
+    void openPerfMap();
+    // The file is dir/jit-<pid>.dump
+    void openJitDump(const std::string& dir);
+
+    bool isOpen() const { return perf_map || jitdump; }
+    bool wantsLines() const { return jitdump; }
+
+    // The functions in an object that has just been loaded.  Their code
+    // isn't done yet at that point; relocations still have to be applied.
+    std::vector<Code>
+    readObject(const llvm::object::ObjectFile& obj,
+               const llvm::RuntimeDyld::LoadedObjectInfo& info);
+    // The code has to be in its final form already
+    void addCode(const Code& code);
+    // Called before code gets freed.  Neither format can say that code is
+    // gone, only that something else is there now, so the range gets
+    // reported again as "[freed] <name>".  jitdump records are timestamped,
+    // and perf inject goes by the latest load of an address at the time of
+    // each sample.  The perf map has no times, and perf report picks one of
+    // the overlapping entries for a range that gets reused.
+    void removeCode(const Code& code);
+
+private:
+    std::mutex lock;
+    FILE* perf_map = nullptr;
+    FILE* jitdump = nullptr;
+    uint64_t code_index = 0; // jitdump wants every load numbered
+
+    void writeJitDump(const Code& code);
+};
+}
+
+#endif
@@ -0,0 +1,74 @@
+#include <stdio.h>
+
+#include "interp.h"
+
+// The optimized traces this prints get checked with FileCheck (see the
+// metadata target in the Makefile).  Each check starts at the marker that
+// comes before the optimized module, since the unoptimized one gets printed
+// first.
+
+int x;
+long y;
+int a[2], b[2];
+
+void storeLong(long* q) __attribute__((noinline));
+void storeLong(long* q) {
+    *q = 1;
+}
+
+// The callee's TBAA comes along into the trace, so the store can't change *p
+// and the second load goes away.
+int reloadAcrossCall(int* p, long* q) {
+    int r = *p;
+    storeLong(q);
+    return r + *p;
+}
+
+// CHECK-LABEL: Optimized traced_reloadAcrossCall_
+// CHECK: define {{.*}}@traced_reloadAcrossCall_
+// CHECK: load i32
+// CHECK: store i64
+// CHECK-NOT: load i32
+// CHECK: ret i32
+
+static inline void copyTwo(int* restrict dst, const int* restrict src) {
+    dst[0] = src[0];
+    dst[1] = src[1];
+}
+
+void copyPair(int* dst, const int* src) __attribute__((noinline));
+void copyPair(int* dst, const int* src) {
+    copyTwo(dst, src);
+}
+
+// clang leaves copyTwo's noalias scopes in copyPair, and the trace gets its
+// own copies of them.
+int copyAndSum(int* dst, int* src) {
+    copyPair(dst, src);
+    return dst[0] + dst[1];
+}
+
+// CHECK-LABEL: Optimized traced_copyAndSum_
+// CHECK: define {{.*}}@traced_copyAndSum_
+// CHECK: store i32 {{.*}}!alias.scope
+
+int main() {
+    loadBitcode("test/metadata.c.ll");
+
+    setJitHotThreshold(1);
+
+    x = 2;
+    JitTarget* reload = createJitTarget(&reloadAcrossCall, 2);
+    long recorded = runJitTarget2(reload, (long)&x, (long)&y);
+    long jitted = runJitTarget2(reload, (long)&x, (long)&y);
+    printf("reloadAcrossCall: %ld %ld (expected %d)\n", recorded, jitted, reloadAcrossCall(&x, &y));
+
+    b[0] = 3;
+    b[1] = 4;
+    JitTarget* copy = createJitTarget(&copyAndSum, 2);
+    recorded = runJitTarget2(copy, (long)a, (long)b);
+    jitted = runJitTarget2(copy, (long)a, (long)b);
+    printf("copyAndSum: %ld %ld (expected %d)\n", recorded, jitted, copyAndSum(a, b));
+
+    return 0;
+}
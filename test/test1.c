@@ -24,6 +24,7 @@ int target(int x, int y) {
 int main() {
     loadBitcode("test/test1.c.ll");
 
+    setJitHotThreshold(1);
     JitTarget* jit_target = createJitTarget(&target, 2);
 
     struct timespec start;
@@ -35,14 +36,38 @@ int main() {
     printf("Expected   : %ld %ldns\n", expected, 1000000000 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec);
 
     clock_gettime(CLOCK_REALTIME, &start);
-    long interpreted = runJitTarget(jit_target, 3, 5);
+    long interpreted = runJitTarget2(jit_target, 3, 5);
     clock_gettime(CLOCK_REALTIME, &end);
     printf("Interpreted: %ld %ldns\n", interpreted, 1000000000 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec);
 
     clock_gettime(CLOCK_REALTIME, &start);
-    long jitted = runJitTarget(jit_target, 3, 5);
+    long jitted = runJitTarget2(jit_target, 3, 5);
     clock_gettime(CLOCK_REALTIME, &end);
     printf("Jitted     : %ld %ldns\n", jitted, 1000000000 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec);
 
+    // Once testStrConstant has a trace of its own, traces of its callers call
+    // that rather than tracing into it again.
+    JitTarget* callee_target = createJitTarget(&testStrConstant, 1);
+    runJitTarget1(callee_target, (long)"hello world");
+    JitTarget* caller_target = createJitTarget(&target, 2);
+    runJitTarget2(caller_target, 3, 5);
+    clock_gettime(CLOCK_REALTIME, &start);
+    long composed = runJitTarget2(caller_target, 3, 5);
+    clock_gettime(CLOCK_REALTIME, &end);
+    printf("Composed   : %ld %ldns\n", composed, 1000000000 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec);
+
+    // With background compilation the recording call returns before the
+    // trace is ready, and calls keep running natively until it is.
+    setJitAsyncCompile(1);
+    JitTarget* async_target = createJitTarget(&target, 2);
+    long recorded = runJitTarget2(async_target, 3, 5);
+    long pending = runJitTarget2(async_target, 3, 5);
+    waitForJitCompiles();
+    clock_gettime(CLOCK_REALTIME, &start);
+    long async_jitted = runJitTarget2(async_target, 3, 5);
+    clock_gettime(CLOCK_REALTIME, &end);
+    JitCompileStats stats = getJitCompileStats();
+    printf("Async      : %ld %ld %ld %ldns (%ld pending, %ld compiled, %ld cached, for %s)\n", recorded, pending, async_jitted, 1000000000 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec, stats.pending, stats.completed, stats.cache_hits, stats.cpu);
+
     return 0;
 }
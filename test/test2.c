@@ -51,6 +51,12 @@ int testArrayAccess(int x) {
     return array[x];
 }
 
+// Uses the same global as testArrayAccess, from a scope of its own
+int testArraySum(int x) __attribute__((noinline));
+int testArraySum(int x) {
+    return array[x] + array[x + 1];
+}
+
 void testPassPtr(int *x) __attribute__((noinline));
 void testPassPtr(int *x) {
     *x = 1;
@@ -94,6 +100,7 @@ int target(int x, int y) {
     r += o.n;
 
     r += testArrayAccess(r);
+    r += testArraySum(1);
 
     int z;
     testPassPtr(&z);
@@ -122,6 +129,7 @@ int main() {
     loadBitcode("test/test2.c.ll");
     loadBitcode("test/lib.c.ll");
 
+    setJitHotThreshold(1);
     JitTarget* jit_target = createJitTarget(&target, 2);
 
     struct timespec start;
@@ -133,14 +141,29 @@ int main() {
     printf("Expected   : %ld %ldns\n", expected, 1000000000 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec);
 
     clock_gettime(CLOCK_REALTIME, &start);
-    long interpreted = runJitTarget(jit_target, 3, 5);
+    long interpreted = runJitTarget2(jit_target, 3, 5);
     clock_gettime(CLOCK_REALTIME, &end);
     printf("Interpreted: %ld %ldns\n", interpreted, 1000000000 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec);
 
     clock_gettime(CLOCK_REALTIME, &start);
-    long jitted = runJitTarget(jit_target, 3, 5);
+    long jitted = runJitTarget2(jit_target, 3, 5);
     clock_gettime(CLOCK_REALTIME, &end);
     printf("Jitted     : %ld %ldns\n", jitted, 1000000000 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec);
 
+    // Different inputs take different branches, so this has to leave the trace
+    expected = target(5, 3);
+    clock_gettime(CLOCK_REALTIME, &start);
+    long exited = runJitTarget2(jit_target, 5, 3);
+    clock_gettime(CLOCK_REALTIME, &end);
+    printf("Side exit  : %ld (expected %ld) %ldns\n", exited, expected, 1000000000 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec);
+
+    // Once the exit gets hot it is compiled into a bridge
+    for (int i = 0; i < 20; i++)
+        exited = runJitTarget2(jit_target, 5, 3);
+    clock_gettime(CLOCK_REALTIME, &start);
+    exited = runJitTarget2(jit_target, 5, 3);
+    clock_gettime(CLOCK_REALTIME, &end);
+    printf("Bridged    : %ld (expected %ld) %ldns\n", exited, expected, 1000000000 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec);
+
     return 0;
 }
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "interp.h"
+
+// Built with -fno-vectorize -fno-slp-vectorize (see the Makefile), so that
+// the interpreter sees scalar code and any vectors come from the trace
+// pipeline.
+
+#define N 4096
+
+int data[N];
+int out[N];
+
+int sumArray(int n, int unused) {
+    int r = 0;
+    for (int i = 0; i < n; i++)
+        r += data[i];
+    return r;
+}
+
+// Four lanes of the same arithmetic per iteration
+int scaleArray(int n, int factor) {
+    for (int i = 0; i + 3 < n; i += 4) {
+        out[i] = data[i] * factor + 1;
+        out[i + 1] = data[i + 1] * factor + 1;
+        out[i + 2] = data[i + 2] * factor + 1;
+        out[i + 3] = data[i + 3] * factor + 1;
+    }
+    return out[n - 1];
+}
+
+static long nsPerCall(JitTarget* target, int arg) {
+    struct timespec start;
+    struct timespec end;
+    const int calls = 1000;
+
+    clock_gettime(CLOCK_REALTIME, &start);
+    for (int i = 0; i < calls; i++)
+        runJitTarget2(target, N, arg);
+    clock_gettime(CLOCK_REALTIME, &end);
+    return (1000000000 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec) / calls;
+}
+
+// Returns whether both traces got the native answer.  The traces are only
+// checked once compiled, since the recording run is interpreted.
+static int compare(const char* name, void* function, int arg) {
+    // Traces keep the pipeline that was set when they were recorded, but
+    // waiting keeps the two compiles from overlapping the measurements.
+    setJitPipeline("full");
+    JitTarget* scalar = createJitTarget(function, 2);
+    runJitTarget2(scalar, N, arg);
+    waitForJitCompiles();
+    long full = runJitTarget2(scalar, N, arg);
+
+    setJitPipeline("vectorize");
+    JitTarget* vectorized = createJitTarget(function, 2);
+    runJitTarget2(vectorized, N, arg);
+    waitForJitCompiles();
+    long result = runJitTarget2(vectorized, N, arg);
+
+    long expected = ((int (*)(int, int))function)(N, arg);
+    int ok = full == expected && result == expected;
+    printf("%s: %ld %ld (expected %ld)%s, full %ldns, vectorize %ldns\n", name, full, result, expected,
+           ok ? "" : " MISMATCH", nsPerCall(scalar, arg), nsPerCall(vectorized, arg));
+    return ok;
+}
+
+int main() {
+    loadBitcode("test/vectorize.c.ll");
+
+    for (int i = 0; i < N; i++)
+        data[i] = i % 7;
+
+    setJitHotThreshold(1);
+    int ok = compare("sumArray  ", &sumArray, 0);
+    ok &= compare("scaleArray", &scaleArray, 3);
+
+    return ok ? 0 : 1;
+}